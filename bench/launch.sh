@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# launch.sh - Commands launched per second by each launch mode: fork +
+#     execve (the default), posix_spawn (-s) and a pool of pre-forked
+#     zygotes (-z). Runs a script of count /usr/bin/true commands through
+#     tsh in each mode. The fork gap grows with the shell's resident
+#     set, since fork copies its page tables.
+#
+#     Launch latency comes from a second run with a -t trace. It is
+#     measured from the shell starting a launch to the child's exec.
+#     posix_spawn only returns once the exec is done, so for it the
+#     latency is the spawn call itself.
+#
+#     usage: bench/launch.sh [count]
+#
+cd "$(dirname "$0")/.." || exit 1
+N=${1:-2000}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+${CC:-cc} -O2 -o "$TMP/tsh" tsh.c || exit 1
+
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "/usr/bin/true" }' > "$TMP/script"
+
+# field name - The value of "name": in a trace event line
+field() {
+    echo "match(\$0, /\"$1\":[0-9.]+/) ? substr(\$0, RSTART + length(\"$1\") + 3, RLENGTH - length(\"$1\") - 3) + 0 : -1"
+}
+
+# run name "tsh options"
+run() {
+    start=$(date +%s.%N)
+    "$TMP/tsh" -p $2 "$TMP/script" > /dev/null
+    end=$(date +%s.%N)
+    "$TMP/tsh" -p -t "$TMP/trace" $2 "$TMP/script" > /dev/null     # again, traced
+    awk "
+        /\"name\":\"(fork|zygote)\"/ { begin[$(field child)] = $(field ts) }
+        /\"name\":\"spawn\"/         { print $(field dur) }
+        /\"name\":\"exec\"/          { exec[$(field tid)] = $(field ts) }
+        END { for (c in begin) if (c in exec) print exec[c] - begin[c] }
+    " "$TMP/trace" | sort -n > "$TMP/lat"
+    awk -v name="$1" -v n="$N" -v s="$start" -v e="$end" '
+        { lat[NR] = $1 }
+        END {
+            printf "%-8s %6d commands %8.3f s %9.0f commands/s   p50 %7.1f us  p99 %7.1f us\n",
+                   name, n, e - s, n / (e - s),
+                   lat[int((NR - 1) * 0.50) + 1], lat[int((NR - 1) * 0.99) + 1]
+        }' "$TMP/lat"
+}
+
+run fork ""
+run spawn "-s"
+run zygote "-z 4"
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# parse.sh - Command lines parsed per second on long generated lines,
+#     for tsh.c at each git revision rev and as it is in the tree. By
+#     default the revisions are the ones just before and just after the
+#     single-pass lexer. Every line is a distinct "jobs" builtin with
+#     about 900 bytes of arguments. jobs prints nothing when there are
+#     no jobs, so the time goes into reading, parsing and dispatch. The
+#     lines stay under the old 1 KB line limit.
+#
+#     usage: bench/parse.sh [lines [rev ...]]
+#
+cd "$(dirname "$0")/.." || exit 1
+N=${1:-100000}
+[ $# -gt 0 ] && shift
+if [ $# -eq 0 ]; then
+    lexer=$(git log --format=%h --grep='^\[user-008\] Parse' | tail -1)
+    set -- "$lexer^" "$lexer"
+fi
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+awk -v n="$N" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        line = "jobs"
+        for (j = 0; j < 85; j++)
+            line = line " w" i "_" j "x"
+        print line
+    }
+}' > "$TMP/script"
+
+# run name source - The best of five runs
+run() {
+    ${CC:-cc} -O2 -w -o "$TMP/tsh" "$2" || exit 1
+    for i in 1 2 3 4 5; do
+        start=$(date +%s.%N)
+        "$TMP/tsh" -p < "$TMP/script" > /dev/null
+        end=$(date +%s.%N)
+        echo "$start $end"
+    done | awk -v name="$1" -v n="$N" '
+        { t = $2 - $1; if (NR == 1 || t < best) best = t }
+        END { printf "%-10s %7d lines %8.3f s %10.0f lines/s\n", name, n, best, n / best }'
+}
+
+echo "$N lines, $(wc -c < "$TMP/script") bytes"
+for rev in "$@"; do
+    git show "$rev:tsh.c" > "$TMP/rev.c" || exit 1
+    run "$(git rev-parse --short "$rev")" "$TMP/rev.c"
+done
+run tree tsh.c
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# pipesize.sh - Throughput and context switches of a two-stage pipeline
+#     at different pipe capacities (-b). Each run streams size megabytes
+#     from head to wc under tsh's time prefix, which reports the job's
+#     elapsed time and context switches. Sizes above pipe-max-size are
+#     clamped by the shell.
+#
+#     usage: bench/pipesize.sh [megabytes]
+#
+cd "$(dirname "$0")/.." || exit 1
+MB=${1:-1024}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+${CC:-cc} -O2 -o "$TMP/tsh" tsh.c || exit 1
+
+echo "time /usr/bin/head -c ${MB}M /dev/zero | /usr/bin/wc -c" > "$TMP/script"
+echo "pipe-max-size $(cat /proc/sys/fs/pipe-max-size)"
+for size in 64K 256K 1M 4M 16M; do
+    "$TMP/tsh" -p -b "$size" "$TMP/script" | awk -v size="$size" -v mb="$MB" '
+        $1 == "real" { real = $2 + 0 }
+        $1 == "csw"  { csw = $2 + $4 }
+        END { printf "%-5s %8.1f MB/s %9d context switches\n", size, mb / real, csw }'
+done
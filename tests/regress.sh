@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# regress.sh - Build tsh and run command lines through it in batch mode,
+#     checking each one's output and that it finishes in time.
+#
+#     usage: tests/regress.sh [cc]
+#
+cd "$(dirname "$0")/.." || exit 1
+CC=${1:-cc}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+$CC -O2 -o "$TMP/tsh" tsh.c || exit 1
+
+fails=0
+
+# check name "tsh options" "command lines" "expected output"
+#     Meter reports are dropped, times in seconds read "T s" and pids (N).
+check() {
+    printf '%s\n' "$3" > "$TMP/in"
+    printf '%s\n' "$4" > "$TMP/want"
+    timeout 10 "$TMP/tsh" -p $2 < "$TMP/in" 2>&1 | grep -v '^Job \[' \
+        | sed 's/[0-9.]* s$/T s/; s/([0-9]*)/(N)/' > "$TMP/got"
+    if cmp -s "$TMP/want" "$TMP/got"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        diff "$TMP/want" "$TMP/got" | sed 's/^/     /'
+        fails=$((fails + 1))
+    fi
+}
+
+# A zygote forked while a metered job runs must not hold its pipes open
+check "meter with zygotes" "-m -z 2" \
+"/usr/bin/seq 1 100000 | /usr/bin/wc -l
+/usr/bin/seq 1 10 | /usr/bin/sort -rn | /usr/bin/head -3" \
+"100000
+10
+9
+8"
+
+# Exit status 127 from a program that ran drops nothing from the hash
+mkdir "$TMP/b1" "$TMP/b2"
+printf '#!/bin/sh\necho one; exit 127\n' > "$TMP/b1/foo"
+printf '#!/bin/sh\necho two\n' > "$TMP/b2/foo"
+chmod +x "$TMP/b1/foo" "$TMP/b2/foo"
+check "hash keeps a 127 exit" "" \
+"export PATH=$TMP/b1:$TMP/b2:/usr/bin:/bin
+foo
+hash
+/usr/bin/rm $TMP/b1/foo
+foo
+hash
+foo" \
+"one
+hits	command
+   1	$TMP/b1/foo
+foo: Command not found
+hash: hash table empty
+two"
+
+# parallel -f takes job lines of any length, one job per line
+awk 'BEGIN { s = sprintf("%3000s", ""); gsub(/ /, "x", s);
+             print "/usr/bin/echo " s " | /usr/bin/wc -c" }' > "$TMP/jobs"
+check "parallel long lines" "" \
+"parallel -j 1 -f $TMP/jobs" \
+"3001
+parallel: 1 jobs, 0 failed, T s"
+
+# A here-doc's body goes to the command, not into its job's command line
+check "here-doc body not in notices" "" \
+"/usr/bin/sleep 0.2 <<E &
+one
+E
+jobs
+/usr/bin/wc -l <<E
+one
+two
+E" \
+"[1] (N) /usr/bin/sleep 0.2 <<E &
+[1] (N) Running /usr/bin/sleep 0.2 <<E &
+2"
+
+# A job queued by -j has no pid until it starts
+check "queued job in jobs" "-j 1" \
+"/usr/bin/sleep 0.2 &
+/usr/bin/sleep 0.2 &
+jobs" \
+"[1] (N) /usr/bin/sleep 0.2 &
+[2] Queued /usr/bin/sleep 0.2 &
+[1] (N) Running /usr/bin/sleep 0.2 &
+[2] Queued /usr/bin/sleep 0.2 &
+[2] (N) /usr/bin/sleep 0.2 &"
+
+# A new job takes the lowest free job ID
+check "lowest free jid" "" \
+"/usr/bin/sleep 0.1 &
+/usr/bin/sleep 0.15 &
+/usr/bin/sleep 0.5 &
+/usr/bin/sleep 0.3
+/usr/bin/sleep 0.1 &
+/usr/bin/sleep 0.1 &" \
+"[1] (N) /usr/bin/sleep 0.1 &
+[2] (N) /usr/bin/sleep 0.15 &
+[3] (N) /usr/bin/sleep 0.5 &
+[1] (N) /usr/bin/sleep 0.1 &
+[2] (N) /usr/bin/sleep 0.1 &"
+
+[ $fails -eq 0 ]
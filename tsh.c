@@ -2,35 +2,136 @@
  * tsh - A tiny shell program with job control
  * 
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sched.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
  
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define INITJOBS     16   /* initial job table size (it grows as needed) */
+#define HASHSIZE     64   /* buckets in the command hash table */
+#define ENVHASH      64   /* buckets in the environment table */
+#define DEFPATH "/usr/local/bin:/usr/bin:/bin" /* search path if PATH is unset */
+#define COPYCHUNK (1 << 20) /* bytes moved per copy engine call */
+#define ARENABLOCK  4096  /* minimum size of an arena block */
+#define ARENAKEEP  65536  /* most an arena keeps across a reset */
+#define PCACHESIZE    64  /* command lines kept parsed in batch mode */
+#define PCACHEBUCKETS 128 /* buckets in the parse cache */
+#define MAXEVENTS     16  /* epoll events taken per wakeup */
+#define TRACEBUF     1024 /* max size of one trace event */
+#define ZYGOTEMSG  65536  /* max size of a launch request to a zygote */
+#define NOTERING     256  /* job notifications held between drains (a power of 2) */
+#define INPUTBUF (1 << 20) /* bytes read per call from a pipe or terminal */
+#define DIRCACHE      16  /* directory listings kept for globbing */
+#define DIRCACHEMAX (4 << 20) /* largest listing kept, in bytes */
+#define GLOBBUF (256 << 10) /* bytes of directory entries read per getdents64 */
+ 
+/* Placement settings (the run prefix) */
+#define PLACE_CPUS 1 /* --cpus: sched_setaffinity */
+#define PLACE_NICE 2 /* --nice: setpriority */
+#define PLACE_MEM  4 /* --mem: setrlimit(RLIMIT_AS) */
+ 
+/* Job notification kinds */
+#define NOTE_STOP 0 /* Job [jid] (pid) stopped by signal sig */
+#define NOTE_KILL 1 /* Job [jid] (pid) terminated by signal sig */
+ 
+/* What a metered pipe's relay is doing */
+#define RELAY_RUN      0 /* moving data */
+#define RELAY_WAIT_IN  1 /* its pipe from the upstream stage is empty */
+#define RELAY_WAIT_OUT 2 /* its pipe to the downstream stage is full */
+#define RELAY_DONE     3 /* end of data, or the downstream stage is gone */
+ 
+/* Launch modes */
+#define LAUNCH_FORK  0 /* fork + execve */
+#define LAUNCH_SPAWN 1 /* posix_spawn (vfork-style, no page-table copy) */
+ 
+/* Copy engine methods */
+#define COPY_RANGE    0 /* copy_file_range: file to file, in the kernel */
+#define COPY_SPLICE   1 /* splice: either side is a pipe */
+#define COPY_SENDFILE 2 /* sendfile: from a file to anything */
+#define COPY_RW       3 /* read/write through a user buffer */
+ 
+/* errno values meaning "this call can't do this pair of descriptors"
+ * (EBADF is what an O_APPEND destination gets) */
+#define COPY_UNSUPPORTED(e) ((e) == EINVAL || (e) == ENOSYS || (e) == EXDEV \
+                             || (e) == EOPNOTSUPP || (e) == EBADF)
+ 
+/* Event loop sources, the high half of an epoll key */
+#define EV_SIGNAL 1 /* the signalfd */
+#define EV_INPUT  2 /* the shell's stdin */
+#define EV_PROC   3 /* a child's pidfd; the low half is its pid */
+#define EV_RELAY  4 /* a metered pipe; the low half is its slot */
+#define EV_KEY(kind, id) (((uint64_t)(kind) << 32) | (uint32_t)(id))
+ 
+/* Redirection types */
+#define REDIR_IN      0 /* < file */
+#define REDIR_OUT     1 /* > file */
+#define REDIR_HEREDOC 2 /* <<word, then lines up to word */
+#define REDIR_HERESTR 3 /* <<< word */
+ 
+/* Token types */
+#define TOK_END   0 /* end of line */
+#define TOK_WORD  1 /* a word, quotes removed */
+#define TOK_PIPE  2 /* | or |[SIZE] */
+#define TOK_IN    3 /* < */
+#define TOK_OUT   4 /* > */
+#define TOK_AMP   5 /* & */
+#define TOK_ERROR 6 /* lexical error */
+#define TOK_HEREDOC 7 /* << */
+#define TOK_HERESTR 8 /* <<< */
+#define TOK_SUBST_IN  9  /* <(cmd) */
+#define TOK_SUBST_OUT 10 /* >(cmd) */
  
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define QU 4    /* queued, waiting for a background slot */
+#define NSTATES 5
  
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ *     QU (queued)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     QU -> BG  : fewer than -j background jobs running
+ *     QU -> FG  : fg command
+ *     QU -> BG  : bg command
  * At most 1 job can be in the FG state.
  */
  
@@ -38,17 +139,344 @@
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int launch_mode = LAUNCH_FORK; /* how eval starts external commands */
+int zygote_size = 0;        /* pre-forked launch helpers to keep (-z) */
+long pipe_size = 0;         /* capacity for pipeline pipes, 0 = kernel default */
+int bg_limit = 0;           /* background jobs allowed to run at once, 0 = any */
+int meter_pipes = 0;        /* relay pipeline pipes through the shell to meter them (-m) */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
  
+struct redir_t {            /* One redirection of a stage */
+    int type;               /* REDIR_IN, REDIR_OUT, ... */
+    char *word;             /* file name, here-doc delimiter, or here-string text */
+    int doc;                /* here-doc: its body in cmd_docs, -1 for none */
+    struct redir_t *next;   /* next redirection, in command line order */
+};
+struct docs_t {             /* The here-doc bodies of one command line */
+    int n;                  /* how many */
+    int fds[];              /* a sealed memfd each, in command line order */
+};
+struct subst_t {            /* A <(cmd) or >(cmd) argument of a stage */
+    int out;                /* >(cmd): the stage writes, cmd reads */
+    char *word;             /* its argv slot, replaced by /dev/fd/N */
+    struct pipeline_t *pl;  /* cmd, parsed */
+    struct subst_t *next;   /* next one, in command line order */
+};
+struct globarg_t {          /* An argument to expand as a glob */
+    char *word;             /* its argv slot, left as is if nothing matches */
+    char *pattern;          /* the word with quoted *, ?, [ and \ escaped by \ */
+    struct globarg_t *next; /* next one, in command line order */
+};
+struct assign_t {           /* A leading NAME=value word of a stage */
+    char *word;             /* its argv slot */
+    struct assign_t *next;  /* next one, in command line order */
+};
+struct stage_t {            /* One command of a pipeline */
+    char **argv;            /* NULL-terminated argument list */
+    int argc;               /* number of arguments */
+    struct redir_t *redirs; /* redirections or NULL */
+    struct subst_t *substs; /* process substitutions or NULL */
+    struct globarg_t *globs; /* arguments with wildcards or NULL */
+    struct assign_t *assigns; /* NAME=value words or NULL */
+    long pipesize;          /* capacity of the pipe to the next stage, 0 = default */
+};
+struct place_t {            /* Where a job's processes run */
+    int set;                /* PLACE_* bits for the settings given */
+    cpu_set_t cpus;         /* CPUs they may run on */
+    int nice;               /* their nice value */
+    long mem;               /* their address-space limit in bytes */
+};
+struct pipeline_t {         /* A parsed command line */
+    struct stage_t *stages; /* the stages, in order */
+    int nstages;            /* number of stages, at least 1 */
+    int bg;                 /* ends in "&"? */
+    struct place_t *place;  /* from a run prefix, or NULL */
+};
+ 
+struct lexer_t {            /* Tokenizer state for one command line */
+    const char *line;       /* the input */
+    const char *p;          /* next input character */
+    const char *end;        /* end of the input */
+    unsigned long long *meta; /* bit i set if line[i] is in lexclass */
+    char *copy;             /* copy of the input that words are made in */
+    char *out;              /* where the next word's text goes */
+    int plain;              /* are blanks all it has from lexclass? */
+    const char *word;       /* text of the last TOK_WORD */
+    const char *start;      /* where it began in the input */
+    int glob;               /* did it have an unquoted *, ? or [? */
+    int assign;             /* did it have an unquoted =? */
+    long size;              /* size of the last TOK_PIPE, 0 if none */
+    const char *err;        /* message for TOK_ERROR */
+};
+ 
+struct arenablk_t {         /* One block of an arena */
+    struct arenablk_t *next; /* previously filled block */
+    size_t size;            /* bytes in data */
+    size_t used;            /* bytes of data handed out */
+    char data[];
+};
+struct arena_t {            /* Bump allocator, emptied all at once */
+    struct arenablk_t *blk; /* block being filled, NULL if none */
+    size_t bytes;           /* bytes handed out since the last reset */
+    size_t peak;            /* most bytes any one reset cycle needed */
+};
+ 
+struct pcent_t {            /* A command line kept parsed */
+    char *line;             /* the text, newline included */
+    size_t len;             /* its length */
+    unsigned hash;          /* hash of the text */
+    struct pipeline_t *pl;  /* the parse, never modified after parseline */
+    struct arena_t arena;   /* owns line and pl */
+    struct pcent_t *prev;   /* LRU list, most recently used first */
+    struct pcent_t *next;
+    struct pcent_t *hnext;  /* hash chain */
+};
+struct pcache_t {           /* The parse cache */
+    struct pcent_t *buckets[PCACHEBUCKETS];
+    struct pcent_t *head;   /* most recently used */
+    struct pcent_t *tail;   /* least recently used, evicted first */
+    struct pcent_t *spare;  /* entry whose parse failed, reused next miss */
+    int count;              /* entries in the cache */
+    long hits;              /* lookups answered from the cache */
+    long misses;            /* lookups that had to parse */
+};
+ 
+typedef int stagefn_t(char **argv, int in_fd, int out_fd);
+ 
+/* Builtin flags */
+#define BI_SHELL 1 /* acts on the shell itself: runs alone, never forked */
+#define BI_READS 2 /* reads its stdin */
+ 
+struct builtin_t {          /* A command the shell implements itself */
+    const char *name;
+    void (*cmd)(char **argv); /* BI_SHELL builtins */
+    stagefn_t *stage;       /* the others: run on in_fd/out_fd, return a status */
+    int flags;
+};
+ 
+struct instage_t {          /* A pipeline stage the shell runs itself */
+    stagefn_t *fn;          /* the builtin */
+    char **argv;            /* the stage's arguments, NULL if none */
+    int in_fd;              /* its stdin */
+    int out_fd;             /* its stdout */
+    int tail;               /* is it the last stage? */
+};
+ 
+struct branch_t {           /* One output of the tee stage */
+    const char *name;       /* file name, "stdout" for out_fd */
+    int fd;                 /* where the data goes */
+    int pipe[2];            /* private pipe tee(2) fills, -1 for out_fd */
+    long long bytes;        /* bytes written to it */
+};
+ 
+struct zygote_t {           /* A pre-forked launch helper */
+    pid_t pid;              /* its pid, which the command will have */
+    int sock;               /* our end of its control socket */
+    unsigned envgen;        /* env_gen when it was forked */
+};
+struct zygote_hdr_t {       /* Head of a launch request */
+    pid_t pgid;             /* process group to join, 0 for its own */
+    int argc;               /* strings after the path */
+};
+ 
+struct copy_t {             /* State of one copy engine transfer */
+    int in_fd;              /* source */
+    int out_fd;             /* destination */
+    int method;             /* COPY_RANGE, COPY_SPLICE, COPY_SENDFILE or COPY_RW */
+    char *buf;              /* COPY_RW bounce buffer */
+    size_t len;             /* bytes in buf */
+    size_t off;             /* bytes of buf already written */
+};
+ 
+struct relay_t {            /* The shell's relay on a metered pipe */
+    int in;                 /* read end of the upstream stage's pipe */
+    int out;                /* write end of the downstream stage's pipe */
+    int slot;               /* index in relays, its event loop id */
+    int stage;              /* upstream stage's position in its pipeline */
+    int state;              /* RELAY_RUN, RELAY_WAIT_IN, ... */
+    int events;             /* epoll events asked for on in and out */
+    struct timespec start;  /* when it was set up */
+    struct timespec since;  /* when the current state began */
+    double wait_in;         /* seconds spent in RELAY_WAIT_IN */
+    double wait_out;        /* seconds spent in RELAY_WAIT_OUT */
+    long long bytes;        /* bytes relayed */
+    struct timespec win;    /* start of the current rate window */
+    long long win_bytes;    /* bytes at its start */
+    double rate;            /* bytes/s over the last full window */
+    char *from;             /* upstream command name */
+    char *to;               /* downstream command name */
+    struct relay_t *next;   /* next link of the same job */
+};
+struct relay_t **relays;    /* Relays by slot, NULL for a free slot */
+int nrelays;                /* slots allocated */
+int live_relays;            /* relays not yet RELAY_DONE */
+ 
+struct proc_t {             /* Per-process data, one per pipeline stage */
+    pid_t pid;              /* process ID */
+    int reaped;             /* has the process been reaped? */
+    int status;             /* wait status once reaped */
+    int pidfd;              /* pidfd watched by the event loop, or -1 */
+    struct timespec start;  /* when it was started (CLOCK_MONOTONIC) */
+    struct timespec end;    /* when it was reaped */
+    struct rusage ru;       /* resources it used, once reaped */
+    char cmd[NAME_MAX + 1]; /* name it was found by on PATH, "" if none */
+    struct job_t *job;      /* job the process belongs to */
+    struct proc_t *next;    /* next stage of the same job */
+    struct proc_t *hnext;   /* next process in pid bucket or on spare list */
+};
 struct job_t {              /* Per-job data */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (process group, first stage) */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, FG, BG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int nlive;              /* processes not reaped yet */
+    int status;             /* wait status of the last stage */
+    struct proc_t *procs;   /* processes in pipeline order */
+    struct proc_t *last;    /* last stage */
+    char *cmdline;          /* command line */
+    size_t cmdsize;         /* bytes allocated for cmdline */
+    int timed;              /* print a time report when it finishes? */
+    struct task_t *task;    /* parallel task waiting on the job, or NULL */
+    unsigned long seq;      /* its admission queue entry, while QU */
+    struct place_t place;   /* placement of its processes */
+    struct relay_t *relays; /* its metered pipes (-m), in order */
+    struct docs_t *docs;    /* its here-docs while QU, or NULL */
+    struct job_t *next;     /* next job on the spare list */
+};
+struct jobtab_t {           /* The job list */
+    struct job_t **byjid;   /* byjid[jid] is the job with that jid or NULL */
+    int *freejids;          /* released jids, a min-heap */
+    int nfree;              /* entries in the freejids heap */
+    int maxjid;             /* jids in [1, maxjid] have been handed out */
+    int size;               /* byjid and freejids hold size entries */
+    struct proc_t **bypid;  /* live processes hashed by pid */
+    int nbuckets;           /* number of pid buckets, a power of 2 */
+    int nprocs;             /* processes in the pid hash */
+    int count;              /* jobs on the list */
+    int nstate[NSTATES];    /* ... in each state */
+    struct job_t *fg;       /* the foreground job or NULL */
+    struct job_t *spare;    /* deleted jobs kept for reuse */
+    struct proc_t *spareprocs; /* deleted processes kept for reuse */
+};
+struct jobtab_t jobs;       /* The job list */
+ 
+struct qent_t {             /* A job waiting in the admission queue */
+    int prio;               /* higher starts first, */
+    unsigned long seq;      /* ... then first come, first served */
+    struct job_t *job;      /* stale unless job is QU with this seq */
+};
+struct jobqueue_t {         /* The admission queue, a binary heap */
+    struct qent_t *heap;
+    int n;                  /* entries in the heap */
+    int size;               /* entries allocated */
+    unsigned long seq;      /* sequence number of the last entry */
+} jobqueue;
+ 
+struct task_t {             /* One command run by the parallel builtin */
+    int seq;                /* position in the batch, from 1 */
+    char *cmdline;          /* command line, newline included */
+    struct job_t *job;      /* its job while running, else NULL */
+    int out_fd;             /* memfd collecting its output */
+    int done;               /* has the job finished? */
+    int status;             /* its wait status once done */
+};
+ 
+struct arena_t cmd_arena;   /* owns everything parsed from one command line */
+int parse_cache = 0;        /* keep parsed lines in pcache? (batch mode) */
+struct pcache_t pcache;     /* The parse cache */
+int interrupted;            /* ctrl-c with no foreground job */
+struct job_t *instage_job;  /* job whose stage the shell is running, or NULL */
+int instage_tail;           /* is that stage the last one of the pipeline? */
+int in_subshell;            /* are we a forked child running a shell stage? */
+struct docs_t *cmd_docs;    /* here-docs of the command line being run */
+int *subst_fds;             /* pipe ends the stage being launched gets as /dev/fd/N */
+int nsubst_fds;             /* number of them */
+ 
+int epfd = -1;              /* the event loop's epoll instance */
+int sigfd = -1;             /* signalfd for SIGCHLD, SIGINT and SIGTSTP */
+sigset_t orig_mask;         /* signal mask to give children */
+int pidfd_ok = 1;           /* are exits reported through pidfds? */
+struct zygote_t *zpool;     /* idle launch helpers */
+int zcount;                 /* number of them */
+int trace_fd = -1;          /* -t trace file, or -1 */
+pid_t shell_pid;            /* pid of the shell, the trace's process */
+struct note_t {             /* A job notification waiting to be printed */
+    int kind;               /* NOTE_STOP or NOTE_KILL */
+    int jid;
+    pid_t pid;
+    int sig;
+};
+struct note_t notes[NOTERING]; /* The notification ring */
+unsigned note_head;         /* next record to print */
+unsigned note_tail;         /* next free slot */
+unsigned long note_dropped; /* records lost to a full ring */
+unsigned long note_reported; /* ... of which the user has been told */
+int input_polled;           /* is the input registered with epfd? */
+int input_armed;            /* is its one-shot event armed? */
+struct input_t {            /* Command input, consumed by read_line */
+    int fd;                 /* stdin or the script file */
+    int mapped;             /* is buf the whole file, mmap'd? */
+    int seekable;           /* mapped stdin: keep its offset in step */
+    int synced;             /* has a command been given the offset? */
+    char *buf;              /* the data */
+    size_t size;            /* bytes allocated (or mapped) for buf */
+    size_t pos;             /* start of the unread part of buf */
+    size_t scanned;         /* bytes from pos known to hold no newline */
+    size_t len;             /* end of the data in buf */
+    int eof;                /* has read returned 0? */
+    char *line;             /* the line read_line returns */
+    size_t linesize;        /* bytes allocated for line */
+} input;
+ 
+struct globpat_t {          /* A glob for one path component, compiled */
+    uint64_t accept[256];   /* bit i: element i is not a * and takes the byte */
+    uint64_t star;          /* bits of the * elements */
+    uint64_t init;          /* states before any input */
+    int final;              /* the accepting state */
+    int dot;                /* does it start with a literal "."? */
+};
+struct strvec_t {           /* A growable list of strings */
+    char **v;
+    int n;                  /* strings in v */
+    int size;               /* entries allocated */
+};
+struct dirlist_t {          /* A directory listing kept for globbing */
+    char *path;             /* the directory as opened, NULL if the slot is free */
+    dev_t dev;              /* its device and inode, */
+    ino_t ino;
+    struct timespec mtime;  /* ... and mtime when it was read */
+    char *names;            /* per entry: a d_type byte, then the name and a NUL */
+    size_t len;             /* bytes in names */
+    unsigned long used;     /* dircache_clock at its last use */
+};
+struct dirent64_t {         /* What getdents64 returns */
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct dirlist_t dircache[DIRCACHE]; /* The directory cache */
+unsigned long dircache_clock; /* ticks once per lookup */
+long dircache_hits;         /* listings served from the cache */
+long dircache_misses;       /* ... and read from the directory */
  
-volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
+struct hashent_t {          /* Resolved command cache entry */
+    char *name;             /* command name as typed */
+    char *path;             /* full path found on PATH */
+    int hits;               /* times the entry has been used */
+    struct hashent_t *next; /* next entry in the same bucket */
+};
+struct hashent_t *cmdhash[HASHSIZE]; /* The command hash table */
+ 
+struct envvar_t {           /* One environment variable */
+    char *str;              /* "NAME=value", as execve wants it */
+    size_t namelen;         /* length of NAME */
+    struct envvar_t *next;  /* next entry in the same bucket */
+};
+struct envvar_t *envtab[ENVHASH]; /* The environment table */
+int env_count;              /* variables in it */
+char **env_block;           /* NULL-terminated envp of them all, NULL when stale */
+unsigned env_gen;           /* bumped by every change */
  
 /* End global variables */
  
@@ -58,50 +486,208 @@ volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
+const struct builtin_t *find_builtin(const char *name);
+void do_quit(char **argv);
+void exit_reports(void);
+void do_jobs(char **argv);
 void do_bgfg(char **argv);
-void waitfg(pid_t pid);
-void sigchld_handler(int sig);
-void sigint_handler(int sig);
-void sigtstp_handler(int sig);
+void waitfg(struct job_t *job);
+ 
+void event_init(void);
+int run_events(int timeout, int want_input);
+void handle_signals(void);
+void reap_stopped(void);
+void reap_exited(pid_t pid);
+void input_open(int fd);
+char *read_line(void);
+void input_fill(void);
+int read_heredoc(const char *delim);
+void docs_free(struct docs_t *docs);
+int heredoc_open(int doc);
+void input_sync(void);
+void input_resync(void);
+void note_post(int kind, int jid, pid_t pid, int sig);
+void note_flush(void);
  
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+struct pipeline_t *parseline(const char *cmdline, struct arena_t *arena,
+                             const char **errp);
+int heredoc_delims(const char *line, struct arena_t *arena, const char ***delimsp);
+char *read_command(void);
+int open_memfd(const char *name, const char *text, size_t len);
+int seal_memfd(int fd);
+int scan_meta(const char *line, size_t len, unsigned long long *bits);
+void lex_init(struct lexer_t *lx, const char *line, size_t len, struct arena_t *arena);
+int lex_words(struct lexer_t *lx, char **argv);
+int lex_next(struct lexer_t *lx);
 void sigquit_handler(int sig);
-void sigusr1_handler(int sig);
  
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int freejid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct jobtab_t *jobs);
+int freejid(struct jobtab_t *jobs); 
+int addjob(struct jobtab_t *jobs, pid_t pid, int state, char *cmdline);
+int addproc(struct jobtab_t *jobs, struct job_t *job, pid_t pid,
+            const struct timespec *start);
+int deletejob(struct jobtab_t *jobs, pid_t pid); 
+void removejob(struct jobtab_t *jobs, struct job_t *job);
+void reapchild(pid_t pid, int status, const struct rusage *ru);
+void setjobstate(struct jobtab_t *jobs, struct job_t *job, int state);
+pid_t fgpid(struct jobtab_t *jobs);
+struct proc_t *getproc(struct jobtab_t *jobs, pid_t pid);
+void reapproc(struct jobtab_t *jobs, struct proc_t *proc);
+void unhashproc(struct jobtab_t *jobs, struct proc_t *proc);
+struct job_t *getjobpid(struct jobtab_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct jobtab_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct jobtab_t *jobs, int longfmt);
+ 
+void queue_job(struct job_t *job, int prio);
+struct job_t *queue_pop(void);
+void admit_jobs(void);
+void start_queued(struct job_t *job, int state);
+struct pipeline_t *strip_prefixes(struct pipeline_t *pl, struct arena_t *arena,
+                                  int *timed, int *prio);
+int parse_place(char ***argvp, struct place_t *place);
+int parse_cpus(const char *str, cpu_set_t *cpus);
+char *format_place(char *buf, size_t size, const struct place_t *place);
+int place_apply(const struct place_t *place);
+ 
+double elapsed(const struct timespec *from, const struct timespec *to);
+void ru_add(struct rusage *dst, const struct rusage *src, int sign);
+void ru_now(struct rusage *ru);
+void reporttime(double real, const struct rusage *ru);
+void reportsince(const struct timespec *t0, const struct rusage *ru0);
+ 
+int relay_open(struct relay_t **list, int in, int stage, const char *from,
+               const char *to, long size);
+void relay_pump(struct relay_t *r);
+void relay_watch(struct relay_t *r, int events);
+void relay_close(struct relay_t *r);
+void relay_free(struct relay_t **list);
+void relay_waits(const struct relay_t *r, const struct timespec *now,
+                 double *wait_in, double *wait_out);
+const char *relay_slowest(struct job_t *job, const struct timespec *now);
+void relay_list(struct job_t *job);
+void relay_report(struct job_t *job);
+char *format_bytes(char *buf, size_t size, double n);
+ 
+void trace_open(const char *file);
+double trace_now(void);
+double trace_ts(const struct timespec *ts);
+void trace(const char *ph, const char *name, double ts, double dur, pid_t tid,
+           const char *fmt, ...);
+char *json_str(char *dst, size_t size, const char *src);
  
+unsigned hash_name(const char *name);
+struct hashent_t *hash_find(const char *name);
+char *hash_lookup(const char *name);
+char *path_search(const char *name, const char *pathenv);
+char *path_lookup(const char *name, char **envp);
+void hash_forget(const char *name);
+void hash_clear(void);
+void do_hash(char **argv);
+ 
+void env_init(void);
+int env_isname(const char *str, size_t len);
+size_t env_namelen(const char *str);
+unsigned env_hash(const char *name, size_t len);
+struct envvar_t **env_find(const char *name, size_t len);
+char *env_get(const char *name);
+void env_set(const char *str);
+void env_unset(const char *name);
+void env_changed(const char *name, size_t len);
+char **env_envp(void);
+char **env_overlay(char **assigns, int n, struct arena_t *arena);
+char **stage_env(const struct stage_t *st, char **argv, char ***envpp,
+                 struct arena_t *arena);
+char **skip_assigns(const struct stage_t *st, char **argv);
+void do_export(char **argv);
+int env_cmp(const void *a, const void *b);
+void do_unset(char **argv);
+void do_parallel(char **argv);
+char *parallel_cmd(struct arena_t *arena, char **tmpl, const char *arg);
+void parallel_start(struct task_t *task, struct arena_t *arena, int null_fd);
+ 
+int parse_size(const char *str, long *size);
+ 
+char *glob_pattern(const char *p, const char *end, struct arena_t *arena);
+int glob_has_meta(const char *p, size_t len);
+int glob_compile(struct globpat_t *gp, const char *p, size_t len);
+int glob_match(const struct globpat_t *gp, const char *name);
+int glob_expand(const char *pattern, struct arena_t *arena, struct strvec_t *out);
+void glob_dir(const char *prefix, size_t plen, const struct globpat_t *gp, int dirs,
+              struct arena_t *arena, struct strvec_t *out);
+struct pipeline_t *expand_globs(struct pipeline_t *pl, struct arena_t *arena);
+void dircache_report(void);
+void strvec_push(struct strvec_t *sv, char *s);
+void *arena_alloc(struct arena_t *arena, size_t size);
+char *arena_strndup(struct arena_t *arena, const char *str, size_t len);
+void *arena_grow(struct arena_t *arena, void *old, size_t used, size_t size);
+void arena_reset(struct arena_t *arena);
+void arena_free(struct arena_t *arena);
+ 
+struct pipeline_t *pcache_parse(const char *cmdline, const char **errp);
+unsigned pcache_hash(const char *s, size_t len);
+void pcache_unlink(struct pcent_t *e);
+void pcache_report(void);
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
 
-char **get_subarray(char **argv, int start, int stop);
-int *split_indices(char **argv, int *count);
+void size_pipe(int fd, long size);
+struct job_t *run_pipeline(struct pipeline_t *pl, int state, char *cmdline,
+                           struct job_t *job, int in_fd0, int out_fdn,
+                           const sigset_t *mask, struct instage_t *inshell);
+char **start_substs(struct pipeline_t *pl, struct stage_t *st, int state, char *cmdline,
+                    struct job_t **jobp, int in_fd0, int out_fdn, const sigset_t *mask);
+pid_t launch_instage(stagefn_t *fn, char **argv, int in_fd, int out_fd, pid_t pgid,
+                     const sigset_t *mask, const struct place_t *place);
+void run_instage(struct instage_t *inshell, struct job_t *job);
+int detach_instage(void);
+void copy_init(struct copy_t *cp, int in_fd, int out_fd);
+ssize_t copy_step(struct copy_t *cp);
+int copy_check(void);
+int copy_wait(struct copy_t *cp);
+long long copy_fd(int in_fd, int out_fd);
+int do_cat(char **argv, int in_fd, int out_fd);
+int do_tee(char **argv, int in_fd, int out_fd);
+int tee_move(int from, int to, size_t n);
+int wait_fd(int fd, int events);
+int do_echo(char **argv, int in_fd, int out_fd);
+int do_printf(char **argv, int in_fd, int out_fd);
+int do_true(char **argv, int in_fd, int out_fd);
+int do_false(char **argv, int in_fd, int out_fd);
+int do_test(char **argv, int in_fd, int out_fd);
+int test_expr(char **argv, int argc);
+int write_all(int fd, const char *buf, size_t len);
+int write_stream(int fd, FILE *fp, char **bufp, size_t *lenp);
+pid_t launch(const char *path, char **argv, char **envp, int in_fd, int out_fd,
+             pid_t pgid, const sigset_t *mask, const struct place_t *place);
+pid_t launch_fork(const char *path, char **argv, char **envp, int in_fd, int out_fd,
+                  pid_t pgid, const sigset_t *mask, const struct place_t *place);
+pid_t launch_spawn(const char *path, char **argv, char **envp, int in_fd, int out_fd,
+                   pid_t pgid, const sigset_t *mask);
+pid_t launch_zygote(const char *path, char **argv, int in_fd, int out_fd, pid_t pgid);
+void zygote_fill(void);
+void zygote_kill(const struct zygote_t *z);
+void zygote_main(int sock);
 /*
  * main - The shell's main routine 
  */
 int main(int argc, char **argv) {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline;
     int emit_prompt = 1; /* emit prompt (default) */
+    int fd;
  
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(STDOUT_FILENO, STDERR_FILENO);
  
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != -1) {
+    while ((c = getopt(argc, argv, "hvpsmb:j:t:z:")) != -1) {
         switch (c) {
             case 'h':             /* print help message */
                 usage();
@@ -111,45 +697,87 @@ int main(int argc, char **argv) {
                 break;
             case 'p':             /* don't print a prompt */
                 emit_prompt = 0;  /* handy for automatic testing */
+                parse_cache = 1;  /* scripts repeat the same lines */
+                break;
+            case 's':             /* launch commands with posix_spawn */
+                launch_mode = LAUNCH_SPAWN;
+                break;
+            case 'm':             /* meter pipeline pipes */
+                meter_pipes = 1;
+                break;
+            case 'z':             /* keep a pool of pre-forked helpers */
+                if ((zygote_size = atoi(optarg)) < 0)
+                    usage();
+                break;
+            case 'j':             /* cap on running background jobs */
+                if ((bg_limit = atoi(optarg)) < 0)
+                    usage();
+                break;
+            case 'b':             /* capacity of pipeline pipes */
+                if (parse_size(optarg, &pipe_size) < 0)
+                    usage();
+                break;
+            case 't':             /* write a Chrome trace of the run */
+                trace_open(optarg);
                 break;
             default:
                 usage();
         }
     }
+
+    /* Commands come from the script file if there is one, else stdin */
+    if (optind < argc - 1)
+        usage();
+    if (optind < argc) {
+        if ((fd = open(argv[optind], O_RDONLY | O_CLOEXEC)) < 0) {
+            printf("%s: %s\n", argv[optind], strerror(errno));
+            exit(1);
+        }
+        emit_prompt = 0;
+        parse_cache = 1;
+    } else
+        fd = STDIN_FILENO;
+    input_open(fd);
  
-    /* Install the signal handlers */
- 
-    Signal(SIGUSR1, sigusr1_handler); /* Child is ready */
- 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* ctrl-c, ctrl-z and child status changes are read from a
+     * signalfd by the event loop rather than caught */
+    event_init();
  
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
  
     /* Initialize the job list */
-    initjobs(jobs);
+    initjobs(&jobs);
+
+    /* Commands get the shell's environment, as changed by export/unset */
+    env_init();
  
     /* Execute the shell's read/eval loop */
     while (1) {
  
+        /* Replace the helpers the last command used */
+        zygote_fill();
+
         /* Read command line */
         if (emit_prompt) {
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
-            fflush(stdout);
+        if ((cmdline = read_command()) == NULL) { /* End of file (ctrl-d) */
+            admit_jobs();
+            while (jobs.nstate[QU] > 0)   /* see the whole batch started */
+                run_events(-1, 0);
+            while (live_relays > 0)       /* their pipes go through us */
+                run_events(-1, 0);
+            exit_reports();
             exit(0);
         }
  
         /* Evaluate the command line */
-    eval(cmdline);
-        fflush(stdout);
+        eval(cmdline);
+        input_resync();
+        arena_reset(&cmd_arena);
+        note_flush();
     } 
  
     exit(0); /* control never reaches here */
@@ -159,345 +787,2179 @@ int main(int argc, char **argv) {
  * eval - Evaluate the command line that the user has just typed in
  * 
  * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.  
+ * then execute it immediately. Otherwise, fork a child process for
+ * each stage of the pipeline and run the job in the context of those
+ * children. If the job is running in the foreground, wait for it to
+ * terminate and then return.  Note: each job must have a unique
+ * process group ID so that our background children don't receive
+ * SIGINT (SIGTSTP) from the kernel when we type ctrl-c (ctrl-z) at
+ * the keyboard.  
 */
 void eval(char *cmdline) {    
-    char *argv[MAXLINE];
-    char cmdline_copy[MAXLINE];
-    strcpy(cmdline_copy, cmdline);
-    int n = parseline(cmdline_copy, argv);    
-    int bg = 0;
-    int pid_list[MAXJOBS];
-    if (argv[0]==NULL)
+    struct pipeline_t *pl;
+    struct instage_t inshell;
+    char **words, **argv;
+    struct job_t *job;
+    const char *err;
+    struct timespec t0;
+    struct rusage ru0;
+    int bg, timed, prio;
+    double ts = trace_now();
+    if (parse_cache)
+        pl = pcache_parse(cmdline, &err);
+    else
+        pl = parseline(cmdline, &cmd_arena, &err);
+    if (trace_fd >= 0) {
+        char line[TRACEBUF / 2];
+        trace("X", "parse", ts, trace_now() - ts, shell_pid, "\"line\":%s",
+              json_str(line, sizeof(line), cmdline));
+    }
+    if (pl == NULL)
     {
+        if (err != NULL)
+            printf("%s\n", err);
         return;
     }
-    else if (freejid(jobs) == 0)
-    {
-        printf("Too much jobs created\n");
+    bg = pl->bg;
+
+    /* "time cmd", "prio n cmd" */
+    if ((pl = strip_prefixes(pl, &cmd_arena, &timed, &prio)) == NULL)
+        return;
+    pl = expand_globs(pl, &cmd_arena);
+    if (timed) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        ru_now(&ru0);
     }
-    if (builtin_cmd(argv)==0){
-    
-    
-    if (strcmp(argv[n-1], "&")==0)
-    {   
-    bg = 1;
-    argv[n-1] = NULL;
-        
+    /* "NAME=value ..." on its own sets the variables, as export does */
+    words = skip_assigns(&pl->stages[0], pl->stages[0].argv);
+    if (pl->nstages == 1 && !bg && *words == NULL) {
+        for (argv = pl->stages[0].argv; argv < words; argv++)
+            env_set(*argv);
+        return;
     }
-    
-    sigset_t set, oldset;
-    sigemptyset(&set);
-    sigemptyset(&oldset);
-    sigaddset(&set, SIGCHLD);
-    sigaddset(&set, SIGINT);
-    sigaddset(&set, SIGTSTP);
-    if (sigprocmask(SIG_SETMASK, &set, NULL)==-1)
-    {
-        perror("sigprocmask");
-        exit(1);
+    if (pl->nstages == 1 && builtin_cmd(words)) {
+        if (timed)
+            reportsince(&t0, &ru0);
+        return;
     }
- 
-    // Signal(SIGINT, SIG_IGN);
-    // Signal(SIGTSTP, SIG_IGN);
-    raise(SIGUSR1);
-    if (ready != 1)
-    {
-        sigsuspend(&set);
+
+    /* With -j, a background job waits its turn behind the others */
+    if (bg && bg_limit > 0 && (jobs.nstate[BG] >= bg_limit || jobs.nstate[QU] > 0)) {
+        job = getjobjid(&jobs, addjob(&jobs, 0, QU, cmdline));
+        job->timed = timed;
+        job->docs = cmd_docs;           /* the job reads them when it starts */
+        cmd_docs = NULL;
+        queue_job(job, prio);
+        printf("[%d] Queued %s", job->jid, job->cmdline);
+        return;
     }
-    ready = 0;
 
-    int c = 0;
-    int *split_factor = split_indices(argv, &c);
-    if (c!=0 && split_factor[c-1] == n-1)
-    {
-        printf("Invalid using of < > |\n");
+    /* Children are only reaped from the event loop, so every stage is
+     * on the job list before the shell can hear about it */
+    job = run_pipeline(pl, bg ? BG : FG, cmdline, NULL, STDIN_FILENO, STDOUT_FILENO,
+                       &orig_mask, &inshell);
+    if (job != NULL)
+        job->timed = timed;
+    if (inshell.argv != NULL)
+        run_instage(&inshell, job);
+    if (job == NULL && timed && inshell.argv != NULL)
+        reportsince(&t0, &ru0);         /* the shell did all the work */
+    if (job == NULL)
         return;
+ 
+    if (!bg){
+        waitfg(job);
+    }
+    else{
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
     }
+}
+
+/*
+ * run_pipeline - Start every stage of a pipeline as a child of the shell.
+ *     Stage i's stdout is connected to stage i+1's stdin by one of the
+ *     nstages-1 pipes, and each pipe end is closed in the shell as soon
+ *     as the stage using it has been started. All stages join the
+ *     process group of the first one. The first stage reads in_fd0 and
+ *     the last writes out_fdn unless redirected. The processes go into
+ *     job if that is a queued job, else a new one. Returns the job, or
+ *     NULL if nothing was started.
+ *
+ *     A stage builtin (cat, echo, ...) at the head or tail of a
+ *     foreground pipeline, or on its own, is not started; it is handed
+ *     back in *inshell for the shell to run once the rest of the job is
+ *     up. One anywhere else runs in a forked copy of the shell without
+ *     an exec. With a NULL inshell every stage is started.
+ *
+ *     The commands of a stage's <(cmd) and >(cmd) arguments are started
+ *     just before it, into the same job (see start_substs). A stage's
+ *     leading NAME=value words go into its command's environment only
+ *     (see stage_env).
+ */
+struct job_t *run_pipeline(struct pipeline_t *pl, int state, char *cmdline,
+                           struct job_t *job, int in_fd0, int out_fdn,
+                           const sigset_t *mask, struct instage_t *inshell) {
+    struct stage_t *stages = pl->stages;
+    int nstages = pl->nstages;
+    int *in_fds = arena_alloc(&cmd_arena, nstages * sizeof(int));
+    int *out_fds = arena_alloc(&cmd_arena, nstages * sizeof(int));
+    struct relay_t *meter = NULL;
+    int prev_read = -1;
+    int i, j;
 
-    int in_fd = 0; // Default input file descriptor
-    int out_fd = 1; // Default output file descriptor
+    if (inshell != NULL)
+        inshell->argv = NULL;
 
-    // Handle input and output redirection
-    for (int i = 0; i < c; i++) {
-        if (strcmp(argv[split_factor[i]], "<") == 0) {
-            in_fd = open(argv[split_factor[i] + 1], O_RDONLY);
-            if (in_fd < 0) {
-                perror("input redirection failed");
-                exit(1);
+    /* Open every redirection first so a bad file starts nothing */
+    for (i = 0; i < nstages; i++) {
+        struct redir_t *r;
+        in_fds[i] = out_fds[i] = -1;
+        for (r = stages[i].redirs; r != NULL; r = r->next) {
+            int *fdp = r->type == REDIR_OUT ? &out_fds[i] : &in_fds[i];
+            if (*fdp >= 0)              /* the last one wins */
+                close(*fdp);
+            switch (r->type) {
+                case REDIR_IN:
+                    *fdp = open(r->word, O_RDONLY | O_CLOEXEC);
+                    break;
+                case REDIR_OUT:
+                    *fdp = open(r->word, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                    break;
+                case REDIR_HEREDOC:
+                    *fdp = heredoc_open(r->doc);
+                    break;
+                default:
+                    *fdp = open_memfd("herestring", r->word, strlen(r->word));
+                    break;
+            }
+            if (*fdp < 0) {
+                perror(r->type == REDIR_OUT ? "output redirection failed"
+                                            : "input redirection failed");
+                break;
             }
-            argv[split_factor[i]] = NULL; // Remove the "<" symbol from the arguments
-        } else if (strcmp(argv[split_factor[i]], ">") == 0) {
-            out_fd = open(argv[split_factor[i] + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (out_fd < 0) {
-                perror("output redirection failed");
-                exit(1);
+            if (trace_fd >= 0) {
+                char file[TRACEBUF / 2];
+                trace("i", "open", trace_now(), 0, shell_pid, "\"file\":%s,\"fd\":%d",
+                      json_str(file, sizeof(file), r->word), *fdp);
             }
-            argv[split_factor[i]] = NULL; // Remove the ">" symbol from the arguments
         }
+        if (r != NULL)
+            break;
     }
-    //     else if (strcmp(arg[split_factor[i]], "|")==0){
-    //         pipe(fd_array[fd_array_size]);
-    //         fd_array_size++;
-    //     }
-    // }
-
- 
-    int pid = fork();
- 
-    
-    if (pid == 0)
-    {
-        // Signal(SIGINT, sigint_handler);
-        // Signal(SIGTSTP, sigtstp_handler);
-        if (sigprocmask(SIG_SETMASK, &oldset, NULL)==-1)
-        {
-            perror("sigprocmask");
-            exit(-1);
+    if (i < nstages) {
+        for (; i >= 0; i--) {
+            if (in_fds[i] >= 0)
+                close(in_fds[i]);
+            if (out_fds[i] >= 0)
+                close(out_fds[i]);
         }
-        setpgid(0, 0);
+        return NULL;
+    }
 
-        if (dup2(in_fd, STDIN_FILENO) == -1) {
-                perror("input redirection failed");
-                exit(1);
-            }
+    for (i = 0; i < nstages; i++) {
+        int pfd[2] = {-1, -1};
+        int in_fd = in_fd0, out_fd = out_fdn;
+        const struct builtin_t *bi = NULL;
+        char **argv = stages[i].argv, **envp;
+        char *path;
+        struct timespec start;
+        pid_t pid = -1;
 
-        if (dup2(out_fd, STDOUT_FILENO) == -1) {
-            perror("output redirection failed");
-            exit(1);
+        if (i < nstages - 1) {
+            if (pipe2(pfd, O_CLOEXEC) < 0) {
+                perror("pipe");
+                pfd[0] = pfd[1] = -1;
+            } else if (stages[i].pipesize > 0)
+                size_pipe(pfd[1], stages[i].pipesize);
+            else if (pipe_size > 0)
+                size_pipe(pfd[1], pipe_size);
+            if (pfd[0] >= 0 && trace_fd >= 0)
+                trace("i", "pipe", trace_now(), 0, shell_pid, "\"fds\":[%d,%d],\"size\":%d",
+                      pfd[0], pfd[1], (int)fcntl(pfd[1], F_GETPIPE_SZ));
+            if (pfd[0] >= 0 && meter_pipes)     /* the shell keeps pfd[0] */
+                pfd[0] = relay_open(&meter, pfd[0], i, stages[i].argv[0],
+                                    stages[i + 1].argv[0],
+                                    stages[i].pipesize > 0 ? stages[i].pipesize : pipe_size);
         }
+        if (prev_read >= 0)
+            in_fd = prev_read;
+        if (pfd[1] >= 0)
+            out_fd = pfd[1];
+        if (in_fds[i] >= 0)             /* explicit redirection wins */
+            in_fd = in_fds[i];
+        if (out_fds[i] >= 0)
+            out_fd = out_fds[i];
+        if (stages[i].substs != NULL)
+            argv = start_substs(pl, &stages[i], state, cmdline, &job, in_fd0, out_fdn, mask);
+        argv = stage_env(&stages[i], argv, &envp, &cmd_arena);
+        if (argv[0] != NULL)
+            bi = find_builtin(argv[0]);
+        if (argv[0] != NULL && in_fd == STDIN_FILENO && (bi == NULL || (bi->flags & BI_READS)))
+            input_sync();               /* the stage may read our input */
 
-        if(c==0)
-        {        
-        
-        execve(argv[0], argv, NULL);    
-        if (errno == ENOENT)
-        {
-            printf("%s: Command not found\n",argv[0]);
-            exit(1);
-        }
+        clock_gettime(CLOCK_MONOTONIC, &start);  /* the launch counts too */
+        if (argv[0] == NULL)
+            ;                           /* only NAME=value: nothing to run */
+        else if (bi != NULL && bi->stage != NULL) {
+            if (inshell != NULL && state == FG && inshell->argv == NULL
+                && (i == 0 || i == nstages - 1)
+                && pl->place == NULL            /* the shell stays where it is */
+                && !meter_pipes                 /* and keeps serving the relays */
+                && stages[i].substs == NULL     /* and never blocks on a /dev/fd */
+                && !(nstages == 1 && (bi->flags & BI_READS) && isatty(in_fd))) {
+                inshell->fn = bi->stage;
+                inshell->argv = argv;
+                inshell->in_fd = in_fd;
+                inshell->out_fd = out_fd;
+                inshell->tail = (i == nstages - 1);
+                /* The shell must not block on its own end of a pipe */
+                if (in_fd == prev_read)
+                    fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+                if (out_fd == pfd[1])
+                    fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+                in_fd = out_fd = -1;    /* keep them open below */
+            } else
+                pid = launch_instage(bi->stage, argv, in_fd, out_fd,
+                                     job != NULL ? job->pid : 0, mask, pl->place);
         }
+        else if ((path = path_lookup(argv[0], envp)) == NULL)
+            printf("%s: Command not found\n", argv[0]);
         else
-        {
-            for(int i=0;i<c;i++){
-            if (strcmp(argv[split_factor[i]], "|")==0){
-            
-            int fd[2*c];
-            for (int x=0;x<c;x++){
-                if((pipe(&fd[2*x])==-1))
-                {
-                    perror("pipe");
-                    exit(1);
-                }
-            }
-            for (int i = 0; i<c;i++){
-                int r;
-                if((r=fork())>0){
-                    if ((dup2(fd[2*i+1], fileno(stdout))) == -1) {
-                        perror("dup2");
-                        exit(1);
-                    }
-
-                    // Parent won't be reading from pipe
-                    if ((close(fd[2*i])) == -1) {
-                        perror("close");
-                    }
-
-                    // Because writes go to stdout, noone should write to fd[1]
-                    if ((close(fd[2*i+1])) == -1) {
-                        perror("close");
-                    }
-                    if(i==0){
-                        execvp(argv[0], get_subarray(argv, 0, split_factor[0]-1));
-                    }
-                    else if (i<c-1){
-                        char **subarray = get_subarray(argv, split_factor[i]+1, split_factor[i+1]-1);
-                        execvp(argv[split_factor[i]+1], subarray);
-                    }
-                }
-                else{
-                    if ((dup2(fd[2*i], fileno(stdin))) == -1) {
-                        perror("dup2");
-                        exit(1);
-                    }
-
-                    // This process will never write to the pipe.
-                    if ((close(fd[2*i+1])) == -1) {
-                        perror("close");
-                    }
-
-                    // Since we reset stdin to read from the pipe, we don't need fd[0]
-                    if ((close(fd[2*i])) == -1) {
-                        perror("close");
-                    }
-                    
-                }
-                if (i==c-1){
-                        pid_list[i+1] = getpid();
-                        execvp(argv[split_factor[c-1]+1], get_subarray(argv, split_factor[c-1]+1, n-1));
-                    }
+            pid = launch(path, argv, envp, in_fd, out_fd,
+                         job != NULL ? job->pid : 0, mask, pl->place);
+        if (pid > 0) {
+            if (trace_fd >= 0) {
+                char name[TRACEBUF / 2];
+                trace("M", "thread_name", 0, 0, pid, "\"name\":%s",
+                      json_str(name, sizeof(name), argv[0]));
             }
-            for(int i=0; i<=c; i++)
-            {
-                printf("%d\n", pid_list[i]);
-                waitpid(pid_list[i], NULL, 0);
+            if (job == NULL)
+                job = getjobjid(&jobs, addjob(&jobs, pid, state, cmdline));
+            else if (job->state == QU) {    /* its first process */
+                job->pid = pid;
+                setjobstate(&jobs, job, state);
             }
-            }
-            }
-            
+            addproc(&jobs, job, pid, &start);
+            if (bi == NULL && strchr(argv[0], '/') == NULL)     /* see reapchild */
+                snprintf(job->last->cmd, sizeof(job->last->cmd), "%s", argv[0]);
+            if (pl->place != NULL)
+                job->place = *pl->place;
         }
-        
 
-        
+        /* The child has its copies now; drop ours right away */
+        for (j = 0; j < nsubst_fds; j++)
+            close(subst_fds[j]);
+        nsubst_fds = 0;
+        if (inshell != NULL && inshell->argv == argv) {
+            in_fd = inshell->in_fd;
+            out_fd = inshell->out_fd;
+        } else
+            in_fd = out_fd = -1;
+        if (prev_read >= 0 && prev_read != in_fd)
+            close(prev_read);
+        if (pfd[1] >= 0 && pfd[1] != out_fd)
+            close(pfd[1]);
+        if (in_fds[i] >= 0 && in_fds[i] != in_fd)
+            close(in_fds[i]);
+        if (out_fds[i] >= 0 && out_fds[i] != out_fd)
+            close(out_fds[i]);
+        prev_read = pfd[0];
     }
-    
+    if (job != NULL) {
+        struct relay_t **link = &job->relays;
+        while (*link != NULL)
+            link = &(*link)->next;
+        *link = meter;
+    } else
+        relay_free(&meter);             /* nothing was started */
+    return job;
+}
 
+/*
+ * start_substs - Start the commands of stage st's <(cmd) and >(cmd)
+ *     arguments in *jobp (creating it if it is NULL), each on its own
+ *     pipe to the stage, so they run alongside it and share its ctrl-c,
+ *     ctrl-z and reaping. A <(cmd) reads in_fd0 and a >(cmd) writes
+ *     out_fdn, as the pipeline's own ends do. Returns a copy of the
+ *     stage's argv naming the stage's pipe ends as /dev/fd/N; those are
+ *     left inheritable in subst_fds for the launch, and run_pipeline
+ *     closes them once the stage is started.
+ */
+char **start_substs(struct pipeline_t *pl, struct stage_t *st, int state, char *cmdline,
+                    struct job_t **jobp, int in_fd0, int out_fdn, const sigset_t *mask) {
+    char **argv = arena_alloc(&cmd_arena, (st->argc + 1) * sizeof(char *));
+    int *fds = arena_alloc(&cmd_arena, st->argc * sizeof(int));
+    int nfds = 0, i;
+    struct subst_t *s;
 
-    if (sigprocmask(SIG_SETMASK, &oldset, NULL)==-1)
-        {
-            perror("sigprocmask");
-            exit(-1);
+    memcpy(argv, st->argv, (st->argc + 1) * sizeof(char *));
+    for (s = st->substs; s != NULL; s = s->next) {
+        struct pipeline_t *sub = expand_globs(s->pl, &cmd_arena);
+        struct job_t *job;
+        int pfd[2];
+
+        /* A prefix may have taken the argument off the stage */
+        for (i = 0; i < st->argc && argv[i] != s->word; i++)
+            ;
+        if (i == st->argc)
+            continue;
+        if (pipe2(pfd, O_CLOEXEC) < 0) {
+            perror("pipe");
+            argv[i] = "/dev/null";
+            continue;
         }
- 
-    if (!bg){
-        addjob(jobs, pid, FG, cmdline);
-        waitfg(pid);
+        if (pipe_size > 0)
+            size_pipe(pfd[1], pipe_size);
+        if (pl->place != NULL && sub->place == NULL) {  /* run's placement covers it */
+            struct pipeline_t *placed = arena_alloc(&cmd_arena, sizeof(*sub));
+            *placed = *sub;
+            placed->place = pl->place;
+            sub = placed;
+        }
+        if (s->out)
+            job = run_pipeline(sub, state, cmdline, *jobp, pfd[0], out_fdn, mask, NULL);
+        else
+            job = run_pipeline(sub, state, cmdline, *jobp, in_fd0, pfd[1], mask, NULL);
+        if (job != NULL)
+            *jobp = job;
+        close(s->out ? pfd[0] : pfd[1]);
+        fds[nfds] = s->out ? pfd[1] : pfd[0];
+        argv[i] = arena_alloc(&cmd_arena, 32);
+        sprintf(argv[i], "/dev/fd/%d", fds[nfds]);
+        nfds++;
     }
- 
-    else{
-        addjob(jobs, pid, BG, cmdline);
-        struct job_t *job = getjobpid(jobs, pid);
-        printf("[%d] (%d) %s", job->jid,  job->pid, job->cmdline);
+
+    /* Only now, so the commands above don't inherit each other's ends */
+    for (i = 0; i < nfds; i++)
+        fcntl(fds[i], F_SETFD, 0);
+    subst_fds = fds;
+    nsubst_fds = nfds;
+    return argv;
+}
+
+/*
+ * launch_instage - Run a shell stage in a forked copy of the shell,
+ *     set up like launch_fork does but without the exec
+ */
+pid_t launch_instage(stagefn_t *fn, char **argv, int in_fd, int out_fd, pid_t pgid,
+                     const sigset_t *mask, const struct place_t *place) {
+    double ts = trace_now();
+    unsigned lo, next;
+    pid_t pid;
+    int i;
+
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return -1;
     }
-    
+    if (pid == 0) {
+        in_subshell = 1;
+        interrupted = 0;
+        Signal(SIGQUIT, SIG_DFL);
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        setpgid(0, pgid);
+        if (in_fd != STDIN_FILENO && dup2(in_fd, STDIN_FILENO) == -1) {
+            perror("input redirection failed");
+            exit(1);
+        }
+        if (out_fd != STDOUT_FILENO && dup2(out_fd, STDOUT_FILENO) == -1) {
+            perror("output redirection failed");
+            exit(1);
+        }
+        if (place != NULL && place_apply(place) < 0)
+            exit(1);
+        /* There is no exec to drop the shell's other descriptors, and a
+         * pipe write end left open here would keep the reader from EOF.
+         * Process substitution ends, named by argv, are kept. */
+        for (lo = 3;; lo = next + 1) {
+            next = ~0U;
+            for (i = 0; i < nsubst_fds; i++)
+                if ((unsigned)subst_fds[i] >= lo && (unsigned)subst_fds[i] < next)
+                    next = subst_fds[i];
+            if (next > lo)
+                close_range(lo, next - 1, 0);
+            if (next == ~0U)
+                break;
+        }
+        exit(fn(argv, STDIN_FILENO, STDOUT_FILENO));
     }
- 
+    setpgid(pid, pgid ? pgid : pid);
+    if (trace_fd >= 0)
+        trace("X", "fork", ts, trace_now() - ts, shell_pid, "\"child\":%d,\"exec\":0", pid);
+    return pid;
 }
 
-char **get_subarray(char **argv, int start, int stop) {
-    int size = stop - start + 1;
-    if (size < 0) {
-        fprintf(stderr, "Error: Invalid start and stop indices\n");
-        return NULL;
-    }
+/*
+ * run_instage - Run the stage run_pipeline left to the shell on the
+ *     descriptors it was given, then close them. If the job is stopped
+ *     meanwhile, detach_instage hands the rest of the work to a child,
+ *     which ends up back here and exits.
+ */
+void run_instage(struct instage_t *inshell, struct job_t *job) {
+    int status;
 
-    char **subarray = (char **)malloc((size + 1) * sizeof(char *));
-    if (subarray == NULL) {
-        perror("Memory allocation failed");
-        exit(EXIT_FAILURE);
-    }
+    fflush(stdout);
+    Signal(SIGPIPE, SIG_IGN);   /* a dead reader must not kill the shell */
+    interrupted = 0;
+    instage_job = job;
+    instage_tail = inshell->tail;
 
-    int i, j = 0;
-    for (i = start; i <= stop; i++) {
-        subarray[j++] = argv[i];
-    }
-    subarray[j] = NULL; // Null-terminate the array
+    status = inshell->fn(inshell->argv, inshell->in_fd, inshell->out_fd);
 
-    return subarray;
+    instage_job = NULL;
+    interrupted = 0;
+    if (in_subshell)
+        exit(status);
+    Signal(SIGPIPE, SIG_DFL);
+    if (inshell->in_fd != STDIN_FILENO)
+        close(inshell->in_fd);
+    if (inshell->out_fd != STDOUT_FILENO)
+        close(inshell->out_fd);
 }
 
-int *split_indices(char **argv, int *count) {
-    int *indices = NULL;
-    int index = 0;
-    int size = 0;
+/*
+ * detach_instage - Called when the job whose stage the shell is running
+ *     has been stopped. Fork a child that joins the job, stops itself,
+ *     and finishes the stage once the job is continued, so the shell can
+ *     go back to the prompt. Returns 1 in the shell and 0 in the child.
+ */
+int detach_instage(void) {
+    struct job_t *job = instage_job;
+    struct proc_t *last;
+    pid_t pid;
 
-    // Iterate over the argv array
-    while (argv[index] != NULL) {
-        // Check if the current argument is "<", ">", or "|"
-        if (strcmp(argv[index], "<") == 0 || strcmp(argv[index], ">") == 0 || strcmp(argv[index], "|") == 0) {
-            // Reallocate memory for the indices array
-            indices = realloc(indices, (size + 1) * sizeof(int));
-            if (indices == NULL) {
-                perror("realloc");
-                exit(EXIT_FAILURE);
-            }
-            // Store the index of the special character
-            indices[size++] = index;
-        }
-        index++;
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return 0;               /* just keep going in the shell */
     }
-
-    // Update the count variable with the number of indices found
-    *count = size;
-
-    return indices;
+    if (pid == 0) {
+        in_subshell = 1;
+        instage_job = NULL;
+        Signal(SIGQUIT, SIG_DFL);
+        Signal(SIGPIPE, SIG_DFL);
+        close(epfd);
+        close(sigfd);
+        sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+        setpgid(0, job->pid);
+        kill(getpid(), SIGTSTP);
+        return 0;
+    }
+    setpgid(pid, job->pid);
+    last = job->last;
+    addproc(&jobs, job, pid, NULL);
+    if (!instage_tail)          /* the job still reports its last stage */
+        job->last = last;
+    return 1;
 }
 
+/*
+ * do_cat - The cat stage: copy each file argument (or in_fd, for none or
+ *     "-") to out_fd with the copy engine. Returns an exit status.
+ */
+int do_cat(char **argv, int in_fd, int out_fd) {
+    int status = 0;
+    int i;
 
+    for (i = 1; argv[i] != NULL || i == 1; i++) {
+        int fd = in_fd;
+        long long n;
 
+        if (argv[i] != NULL && strcmp(argv[i], "-") != 0
+            && (fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        n = copy_fd(fd, out_fd);
+        if (fd != in_fd)
+            close(fd);
+        if (n == -2)                    /* handed off to a child */
+            return 0;
+        if (n < 0) {
+            if (errno != EPIPE && errno != EINTR)
+                fprintf(stderr, "cat: %s\n", strerror(errno));
+            return 1;
+        }
+        if (argv[i] == NULL)
+            break;
+    }
+    return status;
+}
  
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return number of arguments parsed.
+/*
+ * do_tee - The tee stage: copy in_fd to out_fd and to each file argument
+ *     (truncated, or appended to with -a). From a pipe nothing passes
+ *     through user space: each round tee(2) duplicates what the pipe
+ *     holds into a private pipe per file, splice moves the original on
+ *     to out_fd, and then each private pipe to its file. Other input is
+ *     read into a buffer and written to every output. With -v (the
+ *     shell's), the bytes written to each output are reported on
+ *     stderr. Returns an exit status.
  */
-int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to space or quote delimiters */
-    int argc;                   /* number of args */
- 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
- 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
+int do_tee(char **argv, int in_fd, int out_fd) {
+    static char buf[65536];
+    struct branch_t *br;
+    struct stat st;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int nbr = 1, status = 0, err = 0, fromfifo, i;
+    ssize_t n, m;
+
+    argv++;
+    if (*argv != NULL && strcmp(*argv, "-a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        argv++;
+    }
+    for (i = 0; argv[i] != NULL; i++)
+        ;
+    if ((br = calloc(i + 1, sizeof(*br))) == NULL) {
+        fprintf(stderr, "tee: %s\n", strerror(errno));
+        return 1;
     }
-    else {
-        delim = strchr(buf, ' ');
+    fromfifo = fstat(in_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    br[0].name = "stdout";
+    br[0].fd = out_fd;
+    br[0].pipe[0] = br[0].pipe[1] = -1;
+    for (; *argv != NULL; argv++) {
+        struct branch_t *b = &br[nbr];
+        b->name = *argv;
+        b->pipe[0] = b->pipe[1] = -1;
+        if ((b->fd = open(*argv, flags, 0644)) < 0) {
+            fprintf(stderr, "tee: %s: %s\n", *argv, strerror(errno));
+            status = 1;
+            continue;
+        }
+        /* As big as in_fd, so one tee(2) always fits */
+        if (fromfifo && pipe2(b->pipe, O_CLOEXEC) < 0)
+            fromfifo = 0;
+        else if (fromfifo)
+            fcntl(b->pipe[1], F_SETPIPE_SZ, fcntl(in_fd, F_GETPIPE_SZ));
+        nbr++;
     }
+
+    if (nbr == 1) {                     /* no files: just a copy */
+        long long total = copy_fd(in_fd, out_fd);
+        if (total < 0)
+            err = (int)total;
+        else
+            br[0].bytes = total;
+    }
+    while (nbr > 1 && !interrupted && err == 0) {
+        if (fromfifo) {
+            n = tee(in_fd, br[1].pipe[1], COPYCHUNK, SPLICE_F_NONBLOCK);
+            for (i = 2; n > 0 && i < nbr; i++)
+                if ((m = tee(in_fd, br[i].pipe[1], n, SPLICE_F_NONBLOCK)) != n) {
+                    if (m >= 0)
+                        errno = EIO;    /* can't happen: the pipe was empty */
+                    n = -1;
+                }
+        } else
+            n = read(in_fd, buf, sizeof(buf));
+        if (n == 0)
+            break;
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            err = wait_fd(in_fd, POLLIN);
+            continue;
+        }
+        if (n < 0) {
+            err = -1;
+            break;
+        }
+
+        /* n bytes are in buf, or duplicated into every private pipe */
+        for (i = 0; i < nbr && err == 0; i++) {
+            if (!fromfifo)
+                err = write_all(br[i].fd, buf, n);
+            else
+                err = tee_move(i == 0 ? in_fd : br[i].pipe[0], br[i].fd, n);
+            if (err == 0)
+                br[i].bytes += n;
+        }
+        if (err == 0)
+            err = copy_check();
+    }
+
+    if (err == -1 && errno != EPIPE && errno != EINTR)
+        fprintf(stderr, "tee: %s\n", strerror(errno));
+    for (i = 0; i < nbr; i++) {
+        if (verbose && err != -2)
+            fprintf(stderr, "tee: %s: %lld bytes\n", br[i].name, br[i].bytes);
+        if (i > 0) {
+            close(br[i].fd);
+            if (br[i].pipe[0] >= 0) {
+                close(br[i].pipe[0]);
+                close(br[i].pipe[1]);
+            }
+        }
+    }
+    free(br);
+    if (err == -2)                      /* handed off to a child */
+        return 0;
+    return err < 0 ? 1 : status;
+}
  
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-            buf++;
- 
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
+/*
+ * tee_move - Move exactly n bytes, already buffered in pipe from, to fd
+ *     to with splice, or with read and write if to can't take a splice.
+ *     Returns as write_all.
+ */
+int tee_move(int from, int to, size_t n) {
+    static char buf[65536];
+    ssize_t m;
+    int err;
+
+    while (n > 0) {
+        if ((m = splice(from, NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0) {
+            n -= m;
+            continue;
         }
-        else {
-            delim = strchr(buf, ' ');
+        if (m < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if ((err = wait_fd(to, POLLOUT)) < 0)
+                return err;
+            continue;
         }
+        if (m == 0 || !COPY_UNSUPPORTED(errno))
+            return -1;
+        if ((m = read(from, buf, n < sizeof(buf) ? n : sizeof(buf))) <= 0)
+            return -1;
+        if ((err = write_all(to, buf, m)) < 0)
+            return err;
+        n -= m;
     }
-    argv[argc] = NULL;
-    
-    return argc;
+    return 0;
 }
  
+/*
+ * write_all - Write all of buf to fd, waiting out a non-blocking pipe
+ *     and watching the signalfd meanwhile. Returns 0, -1 on error (or
+ *     ctrl-c) and -2 if the rest was handed off to a child.
+ */
+int write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+    int err;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) > 0) {
+            buf += n;
+            len -= n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+        if ((err = wait_fd(fd, POLLOUT)) < 0)
+            return err;
+    }
+    return 0;
+}
  
+/*
+ * wait_fd - Wait for a poll event on a non-blocking fd, watching the
+ *     signalfd meanwhile. Returns 0 when it may be ready, else as
+ *     copy_check.
+ */
+int wait_fd(int fd, int events) {
+    struct pollfd pfd[2];
+
+    pfd[0].fd = fd;
+    pfd[0].events = events;
+    pfd[1].fd = in_subshell ? -1 : sigfd;
+    pfd[1].events = POLLIN;
+    pfd[0].revents = pfd[1].revents = 0;
+    if (poll(pfd, 2, -1) < 0 || pfd[1].revents != 0)
+        return copy_check();
+    return 0;
+}
  
-/* builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/*
+ * write_stream - Close the memstream fp and write what it collected in
+ *     *bufp to fd. Returns as write_all, with -2 meaning the stage must return
+ *     without reporting anything.
  */
-int builtin_cmd(char **argv) {
-    if (strcmp(argv[0], "quit") == 0) {
-        exit(0);
-    } else if (strcmp(argv[0], "jobs") == 0) {
-        listjobs(jobs);
-        return 1;
-    } else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0) {
-        do_bgfg(argv);
-        return 1;
+int write_stream(int fd, FILE *fp, char **bufp, size_t *lenp) {
+    int rc;
+
+    if (fclose(fp) != 0) {
+        free(*bufp);
+        return -1;
     }
-    return 0;     /* not a builtin command */
+    rc = write_all(fd, *bufp, *lenp);
+    free(*bufp);
+    if (rc == -1 && errno != EPIPE && errno != EINTR)
+        fprintf(stderr, "write error: %s\n", strerror(errno));
+    return rc;
 }
  
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
+/*
+ * do_echo - The echo stage: print the arguments separated by spaces,
+ *     with a newline unless the first is -n
+ */
+int do_echo(char **argv, int in_fd, int out_fd) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *fp;
+    int nl = 1;
+    int i = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+        nl = 0;
+        i++;
+    }
+    if ((fp = open_memstream(&buf, &len)) == NULL)
+        return 1;
+    for (; argv[i] != NULL; i++) {
+        fputs(argv[i], fp);
+        if (argv[i + 1] != NULL)
+            putc(' ', fp);
+    }
+    if (nl)
+        putc('\n', fp);
+    switch (write_stream(out_fd, fp, &buf, &len)) {
+        case 0:
+        case -2:
+            return 0;
+        default:
+            return 1;
+    }
+}
+ 
+/*
+ * printf_escape - Emit the backslash escape at *fmtp (just past the
+ *     backslash) to fp and advance *fmtp past it
+ */
+static void printf_escape(FILE *fp, const char **fmtp) {
+    const char *f = *fmtp;
+    int c, n;
+
+    switch (*f) {
+        case 'a':  c = '\a'; f++; break;
+        case 'b':  c = '\b'; f++; break;
+        case 'f':  c = '\f'; f++; break;
+        case 'n':  c = '\n'; f++; break;
+        case 'r':  c = '\r'; f++; break;
+        case 't':  c = '\t'; f++; break;
+        case 'v':  c = '\v'; f++; break;
+        case '\\': c = '\\'; f++; break;
+        case '\0': c = '\\';      break;
+        default:
+            if (*f >= '0' && *f <= '7') {
+                for (c = 0, n = 0; n < 3 && *f >= '0' && *f <= '7'; n++)
+                    c = c * 8 + *f++ - '0';
+            } else {
+                putc('\\', fp);
+                c = *f++;
+            }
+            break;
+    }
+    putc(c, fp);
+    *fmtp = f;
+}
+ 
+/*
+ * do_printf - The printf stage: format the arguments like printf(1),
+ *     reusing the format until they run out. Supports the d i u x X o
+ *     c s f e g conversions with flags, width and precision, %% and the
+ *     usual backslash escapes.
+ */
+int do_printf(char **argv, int in_fd, int out_fd) {
+    char spec[32], *end, *buf = NULL;
+    char **args;
+    const char *f;
+    size_t len = 0;
+    FILE *fp;
+    int status = 0;
+    int used;
+
+    if (argv[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    if ((fp = open_memstream(&buf, &len)) == NULL)
+        return 1;
+    args = argv + 2;
+    do {
+        used = 0;
+        for (f = argv[1]; *f != '\0'; ) {
+            const char *arg;
+            size_t n;
+
+            if (*f == '\\') {
+                f++;
+                printf_escape(fp, &f);
+                continue;
+            }
+            if (*f != '%') {
+                putc(*f++, fp);
+                continue;
+            }
+            if (f[1] == '%') {
+                putc('%', fp);
+                f += 2;
+                continue;
+            }
+            /* Copy the directive, less any length modifier we supply */
+            n = strspn(f + 1, "-+ #0123456789.") + 1;
+            if (n + 3 > sizeof(spec) || f[n] == '\0') {
+                fprintf(stderr, "printf: %s: invalid directive\n", f);
+                status = 1;
+                break;
+            }
+            memcpy(spec, f, n);
+            arg = *args != NULL ? *args++ : NULL;
+            used |= arg != NULL;
+            switch (f[n]) {
+                case 'd':
+                case 'i':
+                case 'u':
+                case 'x':
+                case 'X':
+                case 'o': {
+                    long long v = 0;
+
+                    if (arg != NULL) {
+                        errno = 0;
+                        v = arg[0] == '\'' || arg[0] == '"'
+                            ? (unsigned char)arg[1] : strtoll(arg, &end, 0);
+                        if (arg[0] != '\'' && arg[0] != '"'
+                            && (errno != 0 || end == arg || *end != '\0')) {
+                            fprintf(stderr, "printf: %s: invalid number\n", arg);
+                            status = 1;
+                        }
+                    }
+                    spec[n] = 'l';
+                    spec[n + 1] = 'l';
+                    spec[n + 2] = f[n];
+                    spec[n + 3] = '\0';
+                    fprintf(fp, spec, v);
+                    break;
+                }
+                case 'f':
+                case 'e':
+                case 'E':
+                case 'g':
+                case 'G': {
+                    double v = 0;
+
+                    if (arg != NULL) {
+                        v = strtod(arg, &end);
+                        if (end == arg || *end != '\0') {
+                            fprintf(stderr, "printf: %s: invalid number\n", arg);
+                            status = 1;
+                        }
+                    }
+                    spec[n] = f[n];
+                    spec[n + 1] = '\0';
+                    fprintf(fp, spec, v);
+                    break;
+                }
+                case 'c':
+                    spec[n] = 'c';
+                    spec[n + 1] = '\0';
+                    if (arg != NULL && *arg != '\0')
+                        fprintf(fp, spec, *arg);
+                    break;
+                case 's':
+                    spec[n] = 's';
+                    spec[n + 1] = '\0';
+                    fprintf(fp, spec, arg != NULL ? arg : "");
+                    break;
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid directive\n", f[n]);
+                    status = 1;
+                    f = "";
+                    continue;
+            }
+            f += n + 1;
+        }
+    } while (status == 0 && used && *args != NULL);
+    switch (write_stream(out_fd, fp, &buf, &len)) {
+        case 0:
+            return status;
+        case -2:
+            return 0;
+        default:
+            return 1;
+    }
+}
+ 
+/*
+ * do_true, do_false - The true and false stages
+ */
+int do_true(char **argv, int in_fd, int out_fd) {
+    return 0;
+}
+ 
+int do_false(char **argv, int in_fd, int out_fd) {
+    return 1;
+}
+ 
+/*
+ * test_unary - Evaluate the unary primary op on arg. Returns 0 or 1 if
+ *     op is one, -1 otherwise.
+ */
+static int test_unary(const char *op, const char *arg) {
+    struct stat st;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0')
+        return -1;
+    switch (op[1]) {
+        case 'z':
+            return *arg == '\0';
+        case 'n':
+            return *arg != '\0';
+        case 'r':
+            return access(arg, R_OK) == 0;
+        case 'w':
+            return access(arg, W_OK) == 0;
+        case 'x':
+            return access(arg, X_OK) == 0;
+        case 'e':
+        case 'f':
+        case 'd':
+        case 's':
+            if (stat(arg, &st) < 0)
+                return 0;
+            return op[1] == 'e' || (op[1] == 'f' && S_ISREG(st.st_mode))
+                || (op[1] == 'd' && S_ISDIR(st.st_mode))
+                || (op[1] == 's' && st.st_size > 0);
+        default:
+            return -1;
+    }
+}
+ 
+/*
+ * test_binary - Evaluate the binary primary a op b. Returns 0 or 1, -1 if
+ *     op is not one and -2 if an operand is not a number.
+ */
+static int test_binary(const char *a, const char *op, const char *b) {
+    static const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    long long x, y;
+    char *end;
+    int i;
+
+    if (strcmp(op, "=") == 0)
+        return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(a, b) != 0;
+    for (i = 0; i < 6 && strcmp(op, ops[i]) != 0; i++)
+        ;
+    if (i == 6)
+        return -1;
+    x = strtoll(a, &end, 10);
+    if (end == a || *end != '\0')
+        return -2;
+    y = strtoll(b, &end, 10);
+    if (end == b || *end != '\0')
+        return -2;
+    switch (i) {
+        case 0:  return x == y;
+        case 1:  return x != y;
+        case 2:  return x < y;
+        case 3:  return x <= y;
+        case 4:  return x > y;
+        default: return x >= y;
+    }
+}
+ 
+/*
+ * test_expr - Evaluate a test expression of argc words by the POSIX
+ *     rules for up to four arguments. Returns 0 or 1, or -1 on a
+ *     syntax error and -2 on a bad number.
+ */
+int test_expr(char **argv, int argc) {
+    int r;
+
+    switch (argc) {
+        case 0:
+            return 0;
+        case 1:
+            return argv[0][0] != '\0';
+        case 2:
+            if (strcmp(argv[0], "!") == 0)
+                return argv[1][0] == '\0';
+            return test_unary(argv[0], argv[1]);
+        case 3:
+            if ((r = test_binary(argv[0], argv[1], argv[2])) != -1)
+                return r;
+            if (strcmp(argv[0], "!") == 0)
+                return (r = test_expr(argv + 1, 2)) < 0 ? r : !r;
+            return -1;
+        case 4:
+            if (strcmp(argv[0], "!") == 0)
+                return (r = test_expr(argv + 1, 3)) < 0 ? r : !r;
+            return -1;
+        default:
+            return -1;
+    }
+}
+ 
+/*
+ * do_test - The test and [ stages. Exit status 0 if the expression is
+ *     true, 1 if false and 2 on an error.
+ */
+int do_test(char **argv, int in_fd, int out_fd) {
+    int argc, r;
+
+    for (argc = 1; argv[argc] != NULL; argc++)
+        ;
+    if (strcmp(argv[0], "[") == 0 && strcmp(argv[--argc], "]") != 0) {
+        fprintf(stderr, "[: missing ]\n");
+        return 2;
+    }
+    if ((r = test_expr(argv + 1, argc - 1)) == -1)
+        fprintf(stderr, "%s: syntax error\n", argv[0]);
+    else if (r == -2)
+        fprintf(stderr, "%s: integer expression expected\n", argv[0]);
+    return r < 0 ? 2 : !r;
+}
+ 
+/*
+ * copy_init - Pick the cheapest way to move data from in_fd to out_fd:
+ *     copy_file_range between regular files, splice when either side is
+ *     a pipe, sendfile from a regular file to anything else, and plain
+ *     read/write otherwise. copy_step falls back further if the kernel
+ *     refuses the chosen call.
+ */
+void copy_init(struct copy_t *cp, int in_fd, int out_fd) {
+    struct stat in_st, out_st;
+
+    cp->in_fd = in_fd;
+    cp->out_fd = out_fd;
+    cp->buf = NULL;
+    cp->len = cp->off = 0;
+    cp->method = COPY_RW;
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0)
+        return;
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+        cp->method = COPY_RANGE;
+    else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+        cp->method = COPY_SPLICE;
+    else if (S_ISREG(in_st.st_mode))
+        cp->method = COPY_SENDFILE;
+}
+ 
+/*
+ * copy_step - Move up to COPYCHUNK bytes. Returns the number of bytes
+ *     moved, 0 at end of input, or -1 with errno set (EAGAIN if one side
+ *     is a non-blocking pipe that isn't ready).
+ */
+ssize_t copy_step(struct copy_t *cp) {
+    ssize_t n;
+
+    switch (cp->method) {
+        case COPY_RANGE:
+            n = copy_file_range(cp->in_fd, NULL, cp->out_fd, NULL, COPYCHUNK, 0);
+            if (n >= 0 || !COPY_UNSUPPORTED(errno))
+                return n;
+            cp->method = COPY_SENDFILE;
+            return copy_step(cp);
+        case COPY_SPLICE:
+            n = splice(cp->in_fd, NULL, cp->out_fd, NULL, COPYCHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n >= 0 || !COPY_UNSUPPORTED(errno))
+                return n;
+            cp->method = COPY_RW;
+            return copy_step(cp);
+        case COPY_SENDFILE:
+            n = sendfile(cp->out_fd, cp->in_fd, NULL, COPYCHUNK);
+            if (n >= 0 || !COPY_UNSUPPORTED(errno))
+                return n;
+            cp->method = COPY_RW;
+            return copy_step(cp);
+    }
+
+    if (cp->buf == NULL && (cp->buf = malloc(COPYCHUNK)) == NULL)
+        return -1;
+    if (cp->off == cp->len) {
+        if ((n = read(cp->in_fd, cp->buf, COPYCHUNK)) <= 0)
+            return n;
+        cp->len = n;
+        cp->off = 0;
+    }
+    if ((n = write(cp->out_fd, cp->buf + cp->off, cp->len - cp->off)) > 0)
+        cp->off += n;
+    return n;
+}
+ 
+/*
+ * copy_check - Act on signals that arrived during a copy. Returns 0 to
+ *     go on, -1 on ctrl-c and -2 once the job has been stopped and the
+ *     rest of the copy was handed to a child.
+ */
+int copy_check(void) {
+    if (!in_subshell)
+        handle_signals();
+    if (interrupted) {
+        errno = EINTR;
+        return -1;
+    }
+    if (instage_job != NULL && instage_job->state == ST && detach_instage())
+        return -2;
+    return 0;
+}
+ 
+/*
+ * copy_wait - Wait until the descriptors of an EAGAIN'd transfer are
+ *     ready, watching the signalfd meanwhile. Returns as copy_check.
+ */
+int copy_wait(struct copy_t *cp) {
+    struct pollfd pfd[2];
+    int i, err;
+
+    /* Wait for each side in turn; a regular file is always ready */
+    for (i = 0; i < 2; i++) {
+        pfd[0].fd = i == 0 ? cp->in_fd : cp->out_fd;
+        pfd[0].events = i == 0 ? POLLIN : POLLOUT;
+        pfd[1].fd = in_subshell ? -1 : sigfd;
+        pfd[1].events = POLLIN;
+        pfd[0].revents = pfd[1].revents = 0;
+        while (poll(pfd, 2, -1) < 0 || pfd[1].revents != 0) {
+            if ((err = copy_check()) < 0)
+                return err;
+            if (pfd[0].revents != 0)
+                break;
+        }
+    }
+    return 0;
+}
+ 
+/*
+ * copy_fd - Copy in_fd to out_fd until end of input with the copy engine.
+ *     Returns the number of bytes copied, -1 on error and -2 if the copy
+ *     was handed off to a child (see detach_instage).
+ */
+long long copy_fd(int in_fd, int out_fd) {
+    struct copy_t cp;
+    long long total = 0;
+    ssize_t n;
+    int err;
+
+    copy_init(&cp, in_fd, out_fd);
+    while (!interrupted) {
+        if ((n = copy_step(&cp)) > 0) {
+            total += n;
+            if ((err = copy_check()) < 0) {
+                total = err;
+                break;
+            }
+            continue;
+        }
+        if (n == 0 && cp.off == cp.len)
+            break;
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            total = -1;
+            break;
+        }
+        if (n < 0 && (err = copy_wait(&cp)) < 0) {
+            total = err;
+            break;
+        }
+    }
+    free(cp.buf);
+    return total;
+}
+
+/*
+ * size_pipe - Set the capacity of pipe fd with F_SETPIPE_SZ. Requests
+ *     above /proc/sys/fs/pipe-max-size are clamped to it, or to INT_MAX
+ *     (F_SETPIPE_SZ takes an int) if it can't be read.
+ */
+void size_pipe(int fd, long size) {
+    static long max_size = -1;
+    FILE *fp;
+
+    if (max_size < 0) {
+        max_size = 0;
+        if ((fp = fopen("/proc/sys/fs/pipe-max-size", "r")) != NULL) {
+            if (fscanf(fp, "%ld", &max_size) != 1)
+                max_size = 0;
+            fclose(fp);
+        }
+    }
+    if (max_size > 0 && size > max_size) {
+        if (verbose)
+            printf("pipe size %ld exceeds pipe-max-size, using %ld\n", size, max_size);
+        size = max_size;
+    }
+    if (size > INT_MAX)
+        size = INT_MAX;
+    if (fcntl(fd, F_SETPIPE_SZ, (int)size) < 0)
+        perror("F_SETPIPE_SZ");
+}
+
+/*
+ * launch - Start path (argv[0] resolved) with environment envp and
+ *     in_fd/out_fd as its stdin/stdout and *mask as its signal mask. The
+ *     child joins process group pgid, or starts its own if pgid is 0.
+ *     Hands the command to an idle zygote if there is one, else uses fork
+ *     or posix_spawn depending on launch_mode. Returns the child's pid,
+ *     or -1 if it could not be started.
+ */
+pid_t launch(const char *path, char **argv, char **envp, int in_fd, int out_fd,
+             pid_t pgid, const sigset_t *mask, const struct place_t *place) {
+    pid_t pid;
+
+    /* Only a forked child can place itself before the exec */
+    if (place != NULL)
+        return launch_fork(path, argv, envp, in_fd, out_fd, pgid, mask, place);
+    /* A zygote gets stdin/stdout only, and execs with the environment
+     * it was forked with */
+    while (zcount > 0 && nsubst_fds == 0 && envp == env_block)
+        if ((pid = launch_zygote(path, argv, in_fd, out_fd, pgid)) > 0)
+            return pid;
+    if (launch_mode == LAUNCH_SPAWN)
+        return launch_spawn(path, argv, envp, in_fd, out_fd, pgid, mask);
+    return launch_fork(path, argv, envp, in_fd, out_fd, pgid, mask, NULL);
+}
+
+/*
+ * launch_fork - Classic fork + execve launch path
+ */
+pid_t launch_fork(const char *path, char **argv, char **envp, int in_fd, int out_fd,
+                  pid_t pgid, const sigset_t *mask, const struct place_t *place) {
+    double ts = trace_now();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        if (sigprocmask(SIG_SETMASK, mask, NULL) == -1) {
+            perror("sigprocmask");
+            exit(1);
+        }
+        setpgid(0, pgid);
+        if (in_fd != STDIN_FILENO && dup2(in_fd, STDIN_FILENO) == -1) {
+            perror("input redirection failed");
+            exit(1);
+        }
+        if (out_fd != STDOUT_FILENO && dup2(out_fd, STDOUT_FILENO) == -1) {
+            perror("output redirection failed");
+            exit(1);
+        }
+        if (place != NULL && place_apply(place) < 0)
+            exit(1);
+        if (trace_fd >= 0) {
+            char file[TRACEBUF / 2];
+            trace("i", "exec", trace_now(), 0, getpid(), "\"path\":%s",
+                  json_str(file, sizeof(file), path));
+        }
+        execve(path, argv, envp);
+        if (errno == ENOENT) {
+            /* Stale hash entry; the exit status tells the shell to drop it */
+            printf("%s: Command not found\n", argv[0]);
+            exit(127);
+        }
+        printf("%s: %s\n", argv[0], strerror(errno));
+        exit(1);
+    }
+    setpgid(pid, pgid ? pgid : pid); /* also set it here so there is no window */
+    if (trace_fd >= 0)
+        trace("X", "fork", ts, trace_now() - ts, shell_pid, "\"child\":%d", pid);
+    return pid;
+}
+
+/*
+ * launch_spawn - posix_spawn launch path. glibc implements it with
+ *     clone(CLONE_VM|CLONE_VFORK), so the shell's page tables are never
+ *     copied, and exec failures are reported back to us directly.
+ */
+pid_t launch_spawn(const char *path, char **argv, char **envp, int in_fd, int out_fd,
+                   pid_t pgid, const sigset_t *mask) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    double ts;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, mask);
+
+    ts = trace_now();
+    err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    if (err == 0 && trace_fd >= 0)
+        trace("X", "spawn", ts, trace_now() - ts, shell_pid, "\"child\":%d", pid);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        if (err == ENOENT) {
+            hash_forget(argv[0]);
+            printf("%s: Command not found\n", argv[0]);
+        }
+        else
+            printf("%s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+ 
+/*
+ * launch_zygote - Hand a command to the most recently forked idle
+ *     zygote: the path, argv and target process group go in one
+ *     message, with in_fd and out_fd attached as SCM_RIGHTS. The helper
+ *     execs right away, so the command has the helper's pid. The
+ *     environment is not sent: the helper holds env_block as it was at
+ *     the fork, so one forked before the last change is dropped. Returns
+ *     that pid, or -1 if the helper is gone or stale (it is reaped and
+ *     dropped).
+ */
+pid_t launch_zygote(const char *path, char **argv, int in_fd, int out_fd, pid_t pgid) {
+    static char buf[ZYGOTEMSG];
+    struct zygote_t z = zpool[--zcount];
+    struct zygote_hdr_t hdr;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    double ts = trace_now();
+    size_t len = sizeof(hdr), n;
+    int i;
+
+    if (z.envgen != env_gen) {
+        zygote_kill(&z);
+        return -1;
+    }
+    hdr.pgid = pgid;
+    for (hdr.argc = 0; argv[hdr.argc] != NULL; hdr.argc++)
+        ;
+    for (i = -1; i < hdr.argc; i++) {
+        const char *str = i < 0 ? path : argv[i];
+        if ((n = strlen(str) + 1) > sizeof(buf) - len) {
+            zpool[zcount++] = z;        /* too big: keep the helper */
+            return -1;
+        }
+        memcpy(buf + len, str, n);
+        len += n;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), (int[2]){in_fd, out_fd}, 2 * sizeof(int));
+
+    if (sendmsg(z.sock, &msg, MSG_NOSIGNAL) != (ssize_t)len) {
+        zygote_kill(&z);
+        return -1;
+    }
+    close(z.sock);
+    setpgid(z.pid, pgid ? pgid : z.pid);
+    if (trace_fd >= 0)
+        trace("X", "zygote", ts, trace_now() - ts, shell_pid, "\"child\":%d", z.pid);
+    return z.pid;
+}
+ 
+/*
+ * zygote_fill - Fork helpers until the pool holds zygote_size of them.
+ *     Called when the shell would otherwise be idle, so the fork cost
+ *     is off the launch path. Helpers forked before the environment
+ *     last changed are replaced too.
+ */
+void zygote_fill(void) {
+    int sv[2], i, n;
+    pid_t pid;
+
+    if (zpool == NULL && zygote_size > 0
+        && (zpool = calloc(zygote_size, sizeof(*zpool))) == NULL)
+        unix_error("calloc error");
+    for (i = n = 0; i < zcount; i++) {
+        if (zpool[i].envgen == env_gen)
+            zpool[n++] = zpool[i];
+        else
+            zygote_kill(&zpool[i]);
+    }
+    zcount = n;
+    env_envp();                         /* the helpers inherit it built */
+    while (zcount < zygote_size) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+            perror("socketpair");
+            return;
+        }
+        fflush(stdout);                 /* or the helper would repeat it */
+        if ((pid = fork()) < 0) {
+            perror("fork");
+            close(sv[0]);
+            close(sv[1]);
+            return;
+        }
+        if (pid == 0) {
+            close(sv[0]);
+            zygote_main(sv[1]);
+        }
+        close(sv[1]);
+        setpgid(pid, pid);
+        zpool[zcount].pid = pid;
+        zpool[zcount].sock = sv[0];
+        zpool[zcount].envgen = env_gen;
+        zcount++;
+    }
+}
+ 
+/* zygote_kill - Drop a helper that is gone or no longer wanted */
+void zygote_kill(const struct zygote_t *z) {
+    close(z->sock);
+    kill(z->pid, SIGKILL);
+    waitpid(z->pid, NULL, 0);
+}
+ 
+/*
+ * zygote_main - Body of a helper: wait in a process group of its own
+ *     (out of reach of the terminal) for one launch request, then set
+ *     up and exec like launch_fork's child. Exits quietly once the
+ *     shell closes the socket.
+ */
+void zygote_main(int sock) {
+    static char buf[ZYGOTEMSG];
+    static char *argv[ZYGOTEMSG / 2];
+    struct zygote_hdr_t hdr;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int fds[2] = {-1, -1};
+    int keep[2] = {sock < trace_fd ? sock : trace_fd, sock < trace_fd ? trace_fd : sock};
+    unsigned lo = 3;
+    char *path, *p;
+    ssize_t n;
+    int i;
+
+    setpgid(0, 0);
+    Signal(SIGQUIT, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+    /* A helper may be forked while a job runs and outlive it. Anything
+     * of the shell's it held on to, such as the write end of a metered
+     * pipe, would keep a reader from EOF: keep only sock and the trace */
+    for (i = 0; i < 2; i++) {
+        if (keep[i] >= (int)lo) {
+            if ((unsigned)keep[i] > lo)
+                close_range(lo, keep[i] - 1, 0);
+            lo = keep[i] + 1;
+        }
+    }
+    close_range(lo, ~0U, 0);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf) - 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n < (ssize_t)sizeof(hdr))
+        exit(0);
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    memcpy(&hdr, buf, sizeof(hdr));
+    buf[n] = '\0';
+    path = p = buf + sizeof(hdr);
+    for (i = 0; i < hdr.argc; i++) {
+        p += strlen(p) + 1;
+        argv[i] = p;
+    }
+    argv[i] = NULL;
+
+    if (hdr.pgid != 0)
+        setpgid(0, hdr.pgid);
+    if (dup2(fds[0], STDIN_FILENO) == -1) {
+        perror("input redirection failed");
+        exit(1);
+    }
+    if (dup2(fds[1], STDOUT_FILENO) == -1) {
+        perror("output redirection failed");
+        exit(1);
+    }
+    if (trace_fd >= 0) {
+        char file[TRACEBUF / 2];
+        trace("i", "exec", trace_now(), 0, getpid(), "\"path\":%s",
+              json_str(file, sizeof(file), path));
+    }
+    execve(path, argv, env_block);     /* as of the fork; see launch_zygote */
+    if (errno == ENOENT) {
+        printf("%s: Command not found\n", argv[0]);
+        exit(127);
+    }
+    printf("%s: %s\n", argv[0], strerror(errno));
+    exit(1);
+}
+
+ 
+/* 
+ * parseline - Parse the command line into a pipeline in one pass.
+ * 
+ * Words are split on blanks and on the operators <, >, |, |[SIZE] and
+ * a trailing &, which need no spaces around them. <(cmd) and >(cmd) are
+ * arguments whose commands are parsed along with the line. Words with an
+ * unquoted *, ? or [...] are noted for expand_globs, and words starting
+ * with an unquoted NAME= for stage_env. Single quotes keep
+ * everything literally, double quotes keep everything but \" and \\,
+ * and a backslash outside quotes escapes the next character. A line
+ * with no operator, quote, glob character or = is split at its blanks
+ * in one go. Everything is allocated from arena. Returns NULL for an empty line (*errp set to
+ * NULL) or a syntax error (*errp set to a message).
+ */
+struct pipeline_t *parseline(const char *cmdline, struct arena_t *arena,
+                             const char **errp) {
+    size_t total = strlen(cmdline), len;
+    const char *nl = memchr(cmdline, '\n', total);
+    struct lexer_t lx;
+    struct pipeline_t *pl;
+    struct stage_t *st;
+    struct redir_t **rlink;
+    struct subst_t **slink;
+    struct globarg_t **glink;
+    struct assign_t **alink;
+    char **argv;
+    size_t nargv = 0, maxargv = 16;
+    int tok, ndocs = 0, maxstages = 4, i;
+
+    len = nl != NULL ? (size_t)(nl - cmdline) : total;
+    lex_init(&lx, cmdline, len, arena);
+    *errp = "Invalid using of < > |";
+
+    pl = arena_alloc(arena, sizeof(*pl));
+    pl->stages = arena_alloc(arena, maxstages * sizeof(*pl->stages));
+    pl->nstages = 1;
+    pl->bg = 0;
+    pl->place = NULL;
+    st = &pl->stages[0];
+    st->argc = 0;
+    st->redirs = NULL;
+    st->substs = NULL;
+    st->globs = NULL;
+    st->assigns = NULL;
+    st->pipesize = 0;
+    rlink = &st->redirs;
+    slink = &st->substs;
+    glink = &st->globs;
+    alink = &st->assigns;
+
+    if (lx.plain) {                     /* nothing but words and blanks */
+        if ((st->argc = lex_words(&lx, NULL)) == 0) {
+            *errp = NULL;               /* blank line */
+            return NULL;
+        }
+        st->argv = arena_alloc(arena, (st->argc + 1) * sizeof(char *));
+        lex_words(&lx, st->argv);
+        st->argv[st->argc] = NULL;
+        return pl;
+    }
+
+    /* Every stage's words and NULL, in order; set out at the end */
+    argv = arena_alloc(arena, maxargv * sizeof(*argv));
+    while ((tok = lex_next(&lx)) != TOK_END) {
+        if (pl->bg)                     /* & must come last */
+            return NULL;
+        if (nargv + 2 > maxargv) {      /* room for a word and a NULL */
+            argv = arena_grow(arena, argv, nargv * sizeof(*argv),
+                              2 * maxargv * sizeof(*argv));
+            maxargv *= 2;
+        }
+        switch (tok) {
+            case TOK_WORD:
+                argv[nargv++] = (char *)lx.word;
+                st->argc++;
+                if (lx.assign && env_namelen(lx.start) > 0) {   /* unquoted NAME=, never globbed */
+                    struct assign_t *a = arena_alloc(arena, sizeof(*a));
+                    a->word = (char *)lx.word;
+                    a->next = NULL;
+                    *alink = a;
+                    alink = &a->next;
+                } else if (lx.glob) {   /* expanded when run: see expand_globs */
+                    struct globarg_t *g = arena_alloc(arena, sizeof(*g));
+                    g->pattern = glob_pattern(lx.start, lx.p, arena);
+                    if (!glob_has_meta(g->pattern, strlen(g->pattern)))
+                        break;          /* e.g. "[" on its own */
+                    g->word = (char *)lx.word;
+                    g->next = NULL;
+                    *glink = g;
+                    glink = &g->next;
+                }
+                break;
+            case TOK_IN:
+            case TOK_OUT:
+            case TOK_HEREDOC:
+            case TOK_HERESTR: {
+                struct redir_t *r;
+                if (lex_next(&lx) != TOK_WORD)
+                    return NULL;
+                r = arena_alloc(arena, sizeof(*r));
+                r->word = (char *)lx.word;
+                switch (tok) {
+                    case TOK_IN:
+                        r->type = REDIR_IN;
+                        break;
+                    case TOK_OUT:
+                        r->type = REDIR_OUT;
+                        break;
+                    case TOK_HEREDOC:
+                        r->type = REDIR_HEREDOC;
+                        r->doc = ndocs++;       /* read_command has the body */
+                        break;
+                    default:            /* the string gets a newline */
+                        r->type = REDIR_HERESTR;
+                        r->word = arena_alloc(arena, strlen(lx.word) + 2);
+                        strcpy(r->word, lx.word);
+                        strcat(r->word, "\n");
+                        break;
+                }
+                r->next = NULL;
+                *rlink = r;
+                rlink = &r->next;
+                break;
+            }
+            case TOK_SUBST_IN:
+            case TOK_SUBST_OUT: {
+                struct subst_t *s = arena_alloc(arena, sizeof(*s));
+                if ((s->pl = parseline(lx.word, arena, errp)) == NULL || s->pl->bg) {
+                    if (s->pl != NULL || *errp == NULL)
+                        *errp = "Invalid process substitution";
+                    return NULL;
+                }
+                for (i = 0; i < s->pl->nstages; i++) {  /* no body was read */
+                    struct redir_t *r;
+                    for (r = s->pl->stages[i].redirs; r != NULL; r = r->next)
+                        r->doc = -1;
+                }
+                s->out = (tok == TOK_SUBST_OUT);
+                s->word = (char *)lx.word;
+                s->next = NULL;
+                *slink = s;
+                slink = &s->next;
+                argv[nargv++] = s->word;
+                st->argc++;
+                break;
+            }
+            case TOK_PIPE:
+                if (st->argc == 0)      /* empty stage */
+                    return NULL;
+                argv[nargv++] = NULL;
+                st->pipesize = lx.size;
+                if (pl->nstages == maxstages) {
+                    pl->stages = arena_grow(arena, pl->stages,
+                                            maxstages * sizeof(*pl->stages),
+                                            2 * maxstages * sizeof(*pl->stages));
+                    maxstages *= 2;
+                }
+                st = &pl->stages[pl->nstages++];
+                st->argc = 0;
+                st->redirs = NULL;
+                st->substs = NULL;
+                st->globs = NULL;
+                st->assigns = NULL;
+                st->pipesize = 0;
+                rlink = &st->redirs;
+                slink = &st->substs;
+                glink = &st->globs;
+                alink = &st->assigns;
+                break;
+            case TOK_AMP:
+                pl->bg = 1;
+                break;
+            default:
+                *errp = lx.err;
+                return NULL;
+        }
+    }
+    argv[nargv] = NULL;
+    if (st->argc == 0) {
+        if (pl->nstages == 1 && st->redirs == NULL && !pl->bg)
+            *errp = NULL;               /* blank line */
+        return NULL;
+    }
+    for (i = 0; i < pl->nstages; i++) {
+        pl->stages[i].argv = argv;
+        argv += pl->stages[i].argc + 1;
+    }
+    return pl;
+}
+ 
+/*
+ * heredoc_delims - Find the here-doc delimiters of a command line, in
+ *     order, with their text in arena. Returns how many there are.
+ */
+int heredoc_delims(const char *line, struct arena_t *arena, const char ***delimsp) {
+    size_t len = strlen(line);
+    const char **delims = NULL;
+    struct lexer_t lx;
+    int tok, n = 0;
+
+    lex_init(&lx, line, len, arena);
+    while ((tok = lex_next(&lx)) != TOK_END && tok != TOK_ERROR) {
+        if (tok != TOK_HEREDOC || lex_next(&lx) != TOK_WORD)
+            continue;
+        if (n == 0)                     /* never more than one per 3 bytes */
+            delims = arena_alloc(arena, (len / 3 + 1) * sizeof(*delims));
+        delims[n++] = lx.word;
+    }
+    *delimsp = delims;
+    return n;
+}
+ 
+/*
+ * read_command - Read the next command line. The text of each here-doc
+ *     it has, up to its delimiter line, is read into a memfd of its own
+ *     in cmd_docs rather than into the line, so the line stays what the
+ *     user sees in job notices and the parse cache keys on. Returns
+ *     NULL at end of file.
+ */
+char *read_command(void) {
+    struct arena_t arena = {0};
+    const char **delims;
+    char *line;
+    int ndelims, i;
+
+    docs_free(cmd_docs);                /* the last command's, if no job took them */
+    cmd_docs = NULL;
+    if ((line = read_line()) == NULL)
+        return NULL;
+    if (strstr(line, "<<") == NULL
+        || (ndelims = heredoc_delims(line, &arena, &delims)) == 0) {
+        arena_free(&arena);
+        return line;
+    }
+    if ((cmd_docs = malloc(sizeof(*cmd_docs) + ndelims * sizeof(int))) == NULL)
+        unix_error("malloc error");
+    cmd_docs->n = ndelims;
+    for (i = 0; i < ndelims; i++)
+        cmd_docs->fds[i] = read_heredoc(delims[i]);
+    arena_free(&arena);
+    return line;
+}
+ 
+/* docs_free - Close a command line's here-doc memfds */
+void docs_free(struct docs_t *docs) {
+    int i;
+
+    if (docs == NULL)
+        return;
+    for (i = 0; i < docs->n; i++)
+        if (docs->fds[i] >= 0)
+            close(docs->fds[i]);
+    free(docs);
+}
+ 
+/*
+ * heredoc_open - Return a descriptor for here-doc doc of the command
+ *     being run: a copy of its memfd, or an empty one if it has no body
+ *     (as in a <(cmd)). Returns -1 on error.
+ */
+int heredoc_open(int doc) {
+    if (cmd_docs == NULL || doc < 0 || doc >= cmd_docs->n)
+        return open_memfd("heredoc", "", 0);
+    if (cmd_docs->fds[doc] < 0)
+        return -1;
+    return fcntl(cmd_docs->fds[doc], F_DUPFD_CLOEXEC, 0);
+}
+ 
+/*
+ * open_memfd - Return a sealed memfd holding text, at offset 0: a
+ *     here-doc as a seekable file with no disk I/O and no writer
+ *     process. Returns -1 on error.
+ */
+int open_memfd(const char *name, const char *text, size_t len) {
+    int fd;
+
+    if ((fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        return -1;
+    if (len > 0 && write_all(fd, text, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return seal_memfd(fd);
+}
+ 
+/*
+ * seal_memfd - Rewind a filled memfd and seal it against any change.
+ *     Returns fd, or -1 (with fd closed) on error.
+ */
+int seal_memfd(int fd) {
+    if (lseek(fd, 0, SEEK_SET) < 0
+        || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+ 
+/*
+ * lexclass - Characters that end a run of plain word characters: those
+ *     that end or quote a word, and the glob and = characters the lexer
+ *     notes
+ */
+static const unsigned char lexclass[256] = {
+    [1 ... ' '] = 1,                    /* blanks and control characters */
+    ['\''] = 1, ['"'] = 1, ['\\'] = 1,
+    ['<'] = 1, ['>'] = 1, ['|'] = 1, ['&'] = 1,
+    ['*'] = 1, ['?'] = 1, ['['] = 1, ['='] = 1,
+};
+ 
+/*
+ * scan_meta - Set bit i of bits for each line[i] in lexclass, and every
+ *     bit from len to the end of its word as if the line went on with
+ *     blanks, so the lexer finds the end of every run of plain
+ *     characters with a bit scan. bits has room for len + 1 bits.
+ *     Returns whether anything but blanks was in lexclass. Classifies
+ *     16 bytes at a time with SSE2 where available and 8 bytes at a
+ *     time otherwise.
+ */
+int scan_meta(const char *line, size_t len, unsigned long long *bits) {
+    size_t i = 0;
+    int other = 0;
+#if defined(__SSE2__)
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i x01 = _mm_set1_epi8(0x01), x08 = _mm_set1_epi8(0x08);
+    const __m128i x20 = _mm_set1_epi8(0x20), xfc = _mm_set1_epi8((char)0xfc);
+    const __m128i sq = _mm_set1_epi8('\''), star = _mm_set1_epi8('*');
+    const __m128i lt = _mm_set1_epi8('<'), bar = _mm_set1_epi8('|');
+    const __m128i lb = _mm_set1_epi8('[');
+    __m128i others = _mm_setzero_si128();
+#else
+    const unsigned long long ones = 0x0101010101010101ULL;
+    const unsigned long long lows = 0x7f7f7f7f7f7f7f7fULL;
+    const unsigned long long highs = 0x8080808080808080ULL;
+    unsigned long long others = 0;
+#endif
+
+    memset(bits, 0, (len / 64 + 1) * sizeof(*bits));
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(line + i));
+        /* v <= ' ' unsigned, i.e. max(v, ' ') == ' ' */
+        __m128i b = _mm_cmpeq_epi8(_mm_max_epu8(v, blank), blank);
+        /* One bit set or cleared folds pairs of them: & ', " *, \ |,
+         * and < = > ? differ only in their low two bits */
+        __m128i m = _mm_cmpeq_epi8(_mm_or_si128(v, x01), sq);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_or_si128(v, x08), star));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_or_si128(v, x20), bar));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_and_si128(v, xfc), lt));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, lb));
+        others = _mm_or_si128(others, m);
+        bits[i >> 6] |= (unsigned long long)(unsigned)_mm_movemask_epi8(_mm_or_si128(b, m))
+                        << (i & 63);
+    }
+    other = _mm_movemask_epi8(others) != 0;
+#else
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long x, hit;
+        memcpy(&x, line + i, 8);
+#define HASBYTE(c) (~(((x ^ ones * (c)) & lows) + lows | (x ^ ones * (c))) & highs)
+        hit = HASBYTE('\'') | HASBYTE('"') | HASBYTE('\\') | HASBYTE('<')
+            | HASBYTE('>') | HASBYTE('|') | HASBYTE('&')
+            | HASBYTE('*') | HASBYTE('?') | HASBYTE('[') | HASBYTE('=');
+#undef HASBYTE
+        others |= hit;
+        /* a byte is <= ' ' if neither it nor its low 7 bits + 0x5f reach 0x80 */
+        hit |= ~((x & lows) + ones * (0x80 - ' ' - 1) | x) & highs;
+        /* gather the eight high bits into one byte, first byte lowest */
+        bits[i >> 6] |= ((hit >> 7) * 0x0102040810204080ULL >> 56) << (i & 63);
+    }
+    other = others != 0;
+#endif
+    for (; i < len; i++) {
+        if (lexclass[(unsigned char)line[i]]) {
+            bits[i >> 6] |= 1ULL << (i & 63);
+            other |= (unsigned char)line[i] > ' ';
+        }
+    }
+    bits[len >> 6] |= ~0ULL << (len & 63);
+    return other;
+}
+ 
+/*
+ * lex_init - Set lx up to tokenize the len characters at line. Word
+ *     text goes to a copy of the line in arena, so a word with nothing
+ *     to unquote is already in place and only needs its NUL.
+ */
+void lex_init(struct lexer_t *lx, const char *line, size_t len, struct arena_t *arena) {
+    lx->line = lx->p = line;
+    lx->end = line + len;
+    lx->out = lx->copy = arena_alloc(arena, len + 1);
+    memcpy(lx->copy, line, len);
+    lx->meta = arena_alloc(arena, (len / 64 + 1) * sizeof(*lx->meta));
+    lx->plain = !scan_meta(line, len, lx->meta);
+}
+ 
+/* lex_plain - Return the first character at or after p in lexclass, or end */
+static inline const char *lex_plain(const struct lexer_t *lx, const char *p) {
+    size_t i = p - lx->line;
+    unsigned long long w = lx->meta[i >> 6] >> (i & 63);
+
+    if (w != 0)
+        return p + __builtin_ctzll(w);
+    for (i = (i | 63) + 1; (w = lx->meta[i >> 6]) == 0; i += 64)
+        ;                               /* the bits past the end stop this */
+    return lx->line + i + __builtin_ctzll(w);
+}
+ 
+/*
+ * lex_words - Split a plain line (blanks are all it has from lexclass)
+ *     into words all at once: a word starts at each plain character
+ *     after a blank and ends at each blank after a plain character.
+ *     Fills argv with the words, NUL-terminated in the copy, unless it
+ *     is NULL. Returns how many words there are.
+ */
+int lex_words(struct lexer_t *lx, char **argv) {
+    size_t k, nwords = (lx->end - lx->line) / 64 + 1;
+    unsigned long long w, after, starts, ends, carry = 1;
+    int n = 0;
+
+    for (k = 0; k < nwords; k++) {
+        w = lx->meta[k];
+        after = w << 1 | carry;         /* was the character before a blank? */
+        carry = w >> 63;
+        starts = ~w & after;
+        if (argv == NULL) {
+            n += __builtin_popcountll(starts);
+            continue;
+        }
+        for (; starts != 0; starts &= starts - 1)
+            argv[n++] = lx->copy + (k << 6) + __builtin_ctzll(starts);
+        for (ends = w & ~after; ends != 0; ends &= ends - 1)
+            lx->copy[(k << 6) + __builtin_ctzll(ends)] = '\0';
+    }
+    return n;
+}
+ 
+/*
+ * lex_next - Return the next token of the line. A word's text is written,
+ *     unquoted and NUL-terminated, to lx->out and left in lx->word, as
+ *     is the command inside a <(cmd) or >(cmd), verbatim.
+ */
+int lex_next(struct lexer_t *lx) {
+    const char *p = lx->p, *end = lx->end, *q;
+    char *out;
+    int tok, depth;
+
+    while (p < end && (unsigned char)*p <= ' ')
+        p++;
+    if (p == end) {
+        lx->p = p;
+        return TOK_END;
+    }
+    switch (*p) {
+        case '<':
+            if (p + 1 < end && p[1] == '(') {
+                tok = TOK_SUBST_IN;
+                goto subst;
+            }
+            if (p + 2 < end && p[1] == '<' && p[2] == '<') {
+                lx->p = p + 3;
+                return TOK_HERESTR;
+            }
+            if (p + 1 < end && p[1] == '<') {
+                lx->p = p + 2;
+                return TOK_HEREDOC;
+            }
+            lx->p = p + 1;
+            return TOK_IN;
+        case '>':
+            if (p + 1 < end && p[1] == '(') {
+                tok = TOK_SUBST_OUT;
+                goto subst;
+            }
+            lx->p = p + 1;
+            return TOK_OUT;
+        case '&':
+            lx->p = p + 1;
+            return TOK_AMP;
+        case '|':
+            lx->size = 0;
+            lx->p = p + 1;
+            if (p + 1 < end && p[1] == '[') {   /* |[SIZE] */
+                char buf[32];
+                q = memchr(p + 2, ']', end - p - 2);
+                if (q == NULL || q - p - 2 >= (long)sizeof(buf))
+                    goto badsize;
+                memcpy(buf, p + 2, q - p - 2);
+                buf[q - p - 2] = '\0';
+                if (parse_size(buf, &lx->size) < 0)
+                    goto badsize;
+                lx->p = q + 1;
+            }
+            return TOK_PIPE;
+    }
+
+    out = lx->out;
+    lx->word = out;
+    lx->start = p;
+    lx->glob = lx->assign = 0;
+    while (p < end) {
+        q = lex_plain(lx, p);
+        if (out != lx->copy + (p - lx->line))   /* text moved up by unquoting */
+            memcpy(out, p, q - p);
+        out += q - p;
+        p = q;
+        if (p == end)
+            break;
+        if (*p == '*' || *p == '?' || *p == '[') {
+            lx->glob = 1;               /* see expand_globs */
+            *out++ = *p++;
+        } else if (*p == '=') {
+            lx->assign = 1;             /* see stage_env */
+            *out++ = *p++;
+        } else if (*p == '\'') {
+            if ((q = memchr(p + 1, '\'', end - p - 1)) == NULL) {
+                lx->err = "Unmatched '.";
+                return TOK_ERROR;
+            }
+            memcpy(out, p + 1, q - p - 1);
+            out += q - p - 1;
+            p = q + 1;
+        } else if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\'))
+                    p++;
+                *out++ = *p;
+            }
+            if (p == end) {
+                lx->err = "Unmatched \".";
+                return TOK_ERROR;
+            }
+            p++;
+        } else if (*p == '\\') {
+            if (p + 1 < end && p[1] != '\n')
+                *out++ = p[1];
+            p += 2;
+        } else
+            break;                      /* blank or operator ends the word */
+    }
+    *out++ = '\0';
+    lx->out = out;
+    lx->p = p < end ? p : end;
+    return TOK_WORD;
+
+subst:
+    /* The word is the command inside, up to the matching ) */
+    for (q = p + 2, depth = 1; q < end; q++) {
+        if (*q == '\\' && q + 1 < end)
+            q++;
+        else if (*q == '\'') {
+            if ((q = memchr(q + 1, '\'', end - q - 1)) == NULL)
+                break;
+        } else if (*q == '"') {
+            for (q++; q < end && *q != '"'; q++)
+                if (*q == '\\' && q + 1 < end)
+                    q++;
+            if (q == end)
+                break;
+        } else if (*q == '(')
+            depth++;
+        else if (*q == ')' && --depth == 0)
+            break;
+    }
+    if (q == NULL || q == end) {
+        lx->err = "Unmatched (.";
+        return TOK_ERROR;
+    }
+    out = lx->out;
+    lx->word = out;
+    memcpy(out, p + 2, q - p - 2);
+    out[q - p - 2] = '\0';
+    lx->out = out + (q - p - 1);
+    lx->p = q + 1;
+    return tok;
+
+badsize:
+    lx->err = "Invalid pipe size";
+    return TOK_ERROR;
+}
+ 
+ 
+ 
+/* The builtin commands */
+static const struct builtin_t builtins[] = {
+    {"quit",     do_quit,     NULL,      BI_SHELL},
+    {"jobs",     do_jobs,     NULL,      BI_SHELL},
+    {"bg",       do_bgfg,     NULL,      BI_SHELL},
+    {"fg",       do_bgfg,     NULL,      BI_SHELL},
+    {"hash",     do_hash,     NULL,      BI_SHELL},
+    {"export",   do_export,   NULL,      BI_SHELL},
+    {"unset",    do_unset,    NULL,      BI_SHELL},
+    {"parallel", do_parallel, NULL,      BI_SHELL},
+    {"cat",      NULL,        do_cat,    BI_READS},
+    {"tee",      NULL,        do_tee,    BI_READS},
+    {"echo",     NULL,        do_echo,   0},
+    {"printf",   NULL,        do_printf, 0},
+    {"true",     NULL,        do_true,   0},
+    {"false",    NULL,        do_false,  0},
+    {"test",     NULL,        do_test,   0},
+    {"[",        NULL,        do_test,   0},
+    {NULL,       NULL,        NULL,      0}
+};
+ 
+/* find_builtin - Look up a builtin by name, NULL if there is none */
+const struct builtin_t *find_builtin(const char *name) {
+    const struct builtin_t *bi;
+
+    for (bi = builtins; bi->name != NULL; bi++)
+        if (strcmp(bi->name, name) == 0)
+            return bi;
+    return NULL;
+}
+ 
+/* builtin_cmd - If the user has typed a built-in command that acts on
+ *    the shell itself then execute it immediately. The others are
+ *    pipeline stages and go through run_pipeline.
+ */
+int builtin_cmd(char **argv) {
+    const struct builtin_t *bi = find_builtin(argv[0]);
+
+    if (bi == NULL || !(bi->flags & BI_SHELL))
+        return 0;     /* not a builtin command */
+    bi->cmd(argv);
+    return 1;
+}
+ 
+/* do_quit - Execute the builtin quit command */
+void do_quit(char **argv) {
+    exit_reports();
+    exit(0);
+}
+ 
+/* exit_reports - Print the -v cache reports and any pending notices on the way out */
+void exit_reports(void) {
+    pcache_report();
+    dircache_report();
+    if (verbose)
+        printf("command arena: %zu bytes peak\n",
+               cmd_arena.bytes > cmd_arena.peak ? cmd_arena.bytes : cmd_arena.peak);
+    note_flush();
+}
+ 
+/* do_jobs - Execute the builtin jobs command (jobs -l: per process) */
+void do_jobs(char **argv) {
+    listjobs(&jobs, argv[1] != NULL && strcmp(argv[1], "-l") == 0);
+}
+ 
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
  */
 void do_bgfg(char **argv) {
     if (argv[1] == NULL)
@@ -505,323 +2967,3143 @@ void do_bgfg(char **argv) {
         printf("%s command requires PID or %%jig argument\n", argv[0]);
         return;
     }
-    char *id = argv[1];
+    char *id = argv[1];
+    struct job_t *job;
+    if (id[0] == '%'){
+        int jid = strtol(id+1, NULL, 10);
+        if (jid == 0)
+        {
+            printf("%s: argument must be a PID or %%jid\n", argv[0]);
+            return;
+        }
+        job = getjobjid(&jobs, jid);
+        if(job == NULL){
+            printf("%s: No such job\n", id);
+            return;
+        }
+    }
+    else if (strtol(id, NULL, 10)==0)
+    {
+        printf("%s: argument must be a PID or %%jid\n", argv[0]);
+        return;
+    }
+    else if (strtol(id, NULL, 10)>0)
+    {
+        pid_t pid = strtol(id, NULL, 10);
+        job = getjobpid(&jobs, pid);
+        if (job == NULL)
+        {
+            printf("(%s): No such process\n", id);
+            return;
+        }
+    }
+    else{
+    printf("No such job\n");
+    return;}
+    if (trace_fd >= 0)
+        trace("i", "continue", trace_now(), 0, shell_pid, "\"jid\":%d,\"how\":\"%s\"",
+              job->jid, argv[0]);
+    if (job->state == QU) {             /* start it now, ahead of the queue */
+        start_queued(job, strcmp(argv[0], "fg") == 0 ? FG : BG);
+        return;
+    }
+    if (strcmp(argv[0], "bg")==0 && job->state == ST)
+    {
+        kill(-job->pid, SIGCONT);
+        setjobstate(&jobs, job, BG);
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+        return;
+    }
+    else if (strcmp(argv[0], "fg")==0 && job->state != FG){
+        kill(-job->pid, SIGCONT);
+        setjobstate(&jobs, job, FG);
+        waitfg(job);
+        return;
+        }
+    return;
+    
+ 
+}
+ 
+/*
+ * do_hash - Execute the builtin hash command
+ *     hash             list the cached commands
+ *     hash -r          forget all cached commands
+ *     hash name ...    look up each name and cache it
+ */
+void do_hash(char **argv) {
+    int i;
+    struct hashent_t *ent;
+
+    if (argv[1] == NULL) {
+        int empty = 1;
+        for (i = 0; i < HASHSIZE; i++) {
+            for (ent = cmdhash[i]; ent != NULL; ent = ent->next) {
+                if (empty)
+                    printf("hits\tcommand\n");
+                empty = 0;
+                printf("%4d\t%s\n", ent->hits, ent->path);
+            }
+        }
+        if (empty)
+            printf("hash: hash table empty\n");
+        return;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        hash_clear();
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if (strchr(argv[i], '/') != NULL)
+            continue;
+        if (hash_lookup(argv[i]) == NULL)
+            printf("hash: %s: not found\n", argv[i]);
+        else
+            hash_find(argv[i])->hits = 0;
+    }
+}
+ 
+/*
+ * do_export - Execute the builtin export command
+ *     export               list the environment
+ *     export NAME=value    set NAME for every command started from now on
+ *     export NAME          nothing: every variable is exported
+ */
+void do_export(char **argv) {
+    char **envp, **p, *q;
+    int i;
+
+    if (argv[1] == NULL) {
+        if ((envp = malloc((env_count + 1) * sizeof(char *))) == NULL)
+            unix_error("malloc error");
+        memcpy(envp, env_envp(), (env_count + 1) * sizeof(char *));
+        qsort(envp, env_count, sizeof(char *), env_cmp);
+        for (p = envp; *p != NULL; p++) {
+            q = strchr(*p, '=');
+            printf("export %.*s'", (int)(q - *p + 1), *p);
+            for (q++; *q != '\0'; q++) {
+                if (*q == '\'')
+                    printf("'\\''");
+                else
+                    putchar(*q);
+            }
+            printf("'\n");
+        }
+        free(envp);
+        return;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if (env_namelen(argv[i]) > 0)
+            env_set(argv[i]);
+        else if (!env_isname(argv[i], strlen(argv[i])))
+            printf("export: %s: not a valid identifier\n", argv[i]);
+    }
+}
+ 
+/*
+ * do_unset - Execute the builtin unset command: unset NAME ...
+ */
+void do_unset(char **argv) {
+    int i;
+
+    for (i = 1; argv[i] != NULL; i++) {
+        if (env_isname(argv[i], strlen(argv[i])))
+            env_unset(argv[i]);
+        else
+            printf("unset: %s: not a valid identifier\n", argv[i]);
+    }
+}
+ 
+/*
+ * do_parallel - Execute the builtin parallel command
+ *     parallel [-j N] template ... ::: arg ...
+ *         run template once per arg, with {} replaced by the arg (or the
+ *         arg appended if there is no {})
+ *     parallel [-j N] -f file
+ *         run each line of file as a command line
+ *
+ *     Keeps N jobs (default: one per online CPU) running, starting the
+ *     next as soon as one finishes. Each job's stdout is collected and
+ *     printed in one piece when it finishes. ctrl-c interrupts every
+ *     running job and starts no more.
+ */
+void do_parallel(char **argv) {
+    struct arena_t batch = {0};
+    struct task_t *slots;
+    struct timespec t0, t1;
+    char **tmpl = NULL, **args = NULL;
+    char *file = NULL;
+    FILE *fp = NULL;
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t n;
+    long njobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int nbusy = 0, nstarted = 0, nfailed = 0, stopping = 0, killed = 0;
+    int null_fd, i;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strncmp(argv[i], "-j", 2) == 0) {
+            char *n = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+            if (n == NULL || (njobs = strtol(n, NULL, 10)) <= 0) {
+                printf("parallel: -j requires a positive number\n");
+                return;
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && argv[i + 1] != NULL)
+            file = argv[++i];
+        else
+            break;
+    }
+    if (file == NULL) {
+        tmpl = &argv[i];
+        for (; argv[i] != NULL && strcmp(argv[i], ":::") != 0; i++)
+            ;
+        if (argv[i] == NULL || tmpl == &argv[i]) {
+            printf("usage: parallel [-j N] command ... ::: arg ...\n"
+                   "       parallel [-j N] -f file\n");
+            return;
+        }
+        argv[i] = NULL;                 /* ends the template */
+        args = &argv[i + 1];
+    } else if ((fp = fopen(file, "r")) == NULL) {
+        printf("parallel: %s: %s\n", file, strerror(errno));
+        return;
+    }
+    if (njobs < 1)
+        njobs = 1;
+    if ((null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("parallel: /dev/null");
+        if (fp != NULL)
+            fclose(fp);
+        return;
+    }
+    if ((slots = calloc(njobs, sizeof(*slots))) == NULL)
+        unix_error("calloc error");
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    interrupted = 0;
+    for (;;) {
+        int ncollected = 0;
+
+        /* Fill the free slots */
+        for (i = 0; i < njobs && !stopping; i++) {
+            char *cmd = NULL;
+            if (slots[i].cmdline != NULL)
+                continue;
+            if (fp != NULL) {
+                /* Any length; the command line gets exactly one newline */
+                while (cmd == NULL && (n = getline(&line, &linesize, fp)) >= 0) {
+                    if (n > 0 && line[n - 1] == '\n')
+                        line[--n] = '\0';
+                    if (line[strspn(line, " \t")] == '\0')
+                        continue;
+                    cmd = arena_alloc(&batch, n + 2);
+                    memcpy(cmd, line, n);
+                    memcpy(cmd + n, "\n", 2);
+                }
+            } else if (*args != NULL)
+                cmd = parallel_cmd(&batch, tmpl, *args++);
+            if (cmd == NULL) {
+                stopping = 1;           /* nothing left to start */
+                break;
+            }
+            slots[i].seq = ++nstarted;
+            slots[i].cmdline = cmd;
+            parallel_start(&slots[i], &batch, null_fd);
+            nbusy++;
+        }
+
+        /* Collect what has finished; task->done is set by reapchild */
+        for (i = 0; i < njobs; i++) {
+            struct task_t *task = &slots[i];
+            if (task->cmdline == NULL || !task->done)
+                continue;
+            if (task->out_fd >= 0) {
+                fflush(stdout);
+                lseek(task->out_fd, 0, SEEK_SET);
+                copy_fd(task->out_fd, STDOUT_FILENO);
+                close(task->out_fd);
+            }
+            if (task->status != 0) {
+                nfailed++;
+                if (WIFSIGNALED(task->status))
+                    printf("parallel: job %d killed by signal %d: %s", task->seq,
+                           WTERMSIG(task->status), task->cmdline);
+                else
+                    printf("parallel: job %d exited with %d: %s", task->seq,
+                           WEXITSTATUS(task->status), task->cmdline);
+            }
+            memset(task, 0, sizeof(*task));
+            nbusy--;
+            ncollected++;
+        }
+        if (ncollected > 0)
+            continue;                   /* refill before sleeping */
+
+        if (interrupted && !killed) {
+            stopping = killed = 1;
+            for (i = 0; i < njobs; i++)
+                if (slots[i].job != NULL)
+                    kill(-slots[i].job->pid, SIGINT);
+        }
+        if (nbusy == 0)
+            break;
+        run_events(-1, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("parallel: %d jobs, %d failed, %.3f s\n", nstarted, nfailed,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+    interrupted = 0;
+    close(null_fd);
+    if (fp != NULL)
+        fclose(fp);
+    free(line);
+    free(slots);
+    arena_free(&batch);
+}
+ 
+/*
+ * parallel_cmd - Build the command line for one arg of a template: the
+ *     template words joined by spaces, with each {} replaced by arg in
+ *     single quotes (or arg appended if there is none)
+ */
+char *parallel_cmd(struct arena_t *arena, char **tmpl, const char *arg) {
+    size_t size = 4 * strlen(arg) + 4, len = 0;
+    char *cmd, *p;
+    int i, used = 0;
+
+    for (i = 0; tmpl[i] != NULL; i++) {
+        size += strlen(tmpl[i]) + 1;
+        for (p = tmpl[i]; (p = strstr(p, "{}")) != NULL; p += 2)
+            size += 4 * strlen(arg) + 2;
+    }
+    cmd = arena_alloc(arena, size + 1);
+
+#define PUT_ARG() do {                                          \
+        const char *a;                                          \
+        cmd[len++] = '\'';                                      \
+        for (a = arg; *a != '\0'; a++) {                        \
+            if (*a == '\'') {                                   \
+                memcpy(cmd + len, "'\\''", 4);                  \
+                len += 4;                                       \
+            } else                                              \
+                cmd[len++] = *a;                                \
+        }                                                       \
+        cmd[len++] = '\'';                                      \
+    } while (0)
+
+    for (i = 0; tmpl[i] != NULL; i++) {
+        if (i > 0)
+            cmd[len++] = ' ';
+        for (p = tmpl[i]; *p != '\0'; p++) {
+            if (p[0] == '{' && p[1] == '}') {
+                PUT_ARG();
+                used = 1;
+                p++;
+            } else
+                cmd[len++] = *p;
+        }
+    }
+    if (!used) {
+        cmd[len++] = ' ';
+        PUT_ARG();
+    }
+#undef PUT_ARG
+    cmd[len++] = '\n';
+    cmd[len] = '\0';
+    return cmd;
+}
+ 
+/*
+ * parallel_start - Start task as a background job with stdin from
+ *     null_fd and stdout to a fresh memfd. If nothing could be started
+ *     the task is left done, with the status of a command not found.
+ */
+void parallel_start(struct task_t *task, struct arena_t *arena, int null_fd) {
+    struct docs_t *docs;
+    struct pipeline_t *pl;
+    struct instage_t inshell;
+    const char *err;
+
+    task->done = 1;
+    task->status = 127 << 8;
+    task->job = NULL;
+    task->out_fd = -1;
+    if ((pl = parseline(task->cmdline, arena, &err)) == NULL) {
+        printf("parallel: %s: %s", err != NULL ? err : "empty command",
+               task->cmdline);
+        return;
+    }
+    pl = expand_globs(pl, arena);
+    if ((task->out_fd = memfd_create("parallel", MFD_CLOEXEC)) < 0) {
+        perror("parallel: memfd_create");
+        return;
+    }
+    fflush(stdout);
+    docs = cmd_docs;                    /* a job line has no here-doc bodies */
+    cmd_docs = NULL;
+    task->job = run_pipeline(pl, BG, task->cmdline, NULL, null_fd, task->out_fd,
+                             &orig_mask, &inshell);
+    cmd_docs = docs;
+    if (task->job != NULL) {
+        task->job->task = task;
+        task->done = 0;
+    }
+}
+ 
+/* 
+ * waitfg - Block until job is no longer the foreground job
+ */
+void waitfg(struct job_t *job) {
+    double ts = trace_now();
+    pid_t pid = job->pid;
+    int jid = job->jid;
+
+    /* Refill the helper pool while the job runs */
+    zygote_fill();
+
+    /* The event loop does all the reaping; run it until it has moved
+     * the job out of the foreground. The job is held by pointer, as
+     * its leader may be reaped long before the rest; once removed, the
+     * entry is spare (or reused) and no longer at byjid[jid]. */
+    while (jobs.byjid[jid] == job && job->pid == pid && job->state == FG)
+        run_events(-1, 0);
+    if (trace_fd >= 0)
+        trace("X", "waitfg", ts, trace_now() - ts, shell_pid, "\"pgid\":%d", pid);
+}
+ 
+ 
+/*****************
+ * Event loop
+ *****************/
+ 
+/*
+ * event_init - Block SIGCHLD, SIGINT and SIGTSTP and route them, the
+ *     children's pidfds and stdin through one epoll instance
+ */
+void event_init(void) {
+    struct epoll_event ev;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    if (meter_pipes)            /* a relay writing to a dead stage gets EPIPE */
+        sigaddset(&mask, SIGPIPE);
+    if (sigprocmask(SIG_BLOCK, &mask, &orig_mask) < 0)
+        unix_error("sigprocmask error");
+    /* An ignored signal is discarded before it can reach the signalfd,
+     * and children would inherit SIG_IGN from a non-interactive parent */
+    Signal(SIGCHLD, SIG_DFL);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_KEY(EV_SIGNAL, 0);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    /* A regular file can't be polled (EPERM); it is always readable */
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = EV_KEY(EV_INPUT, 0);
+    input_polled = input_armed = epoll_ctl(epfd, EPOLL_CTL_ADD, input.fd, &ev) == 0;
+}
+ 
+/*
+ * run_events - Wait up to timeout ms (-1 = forever) for events and
+ *     dispatch them. With want_input, stdin is watched too and the
+ *     call returns 1 once it is readable; otherwise it returns after
+ *     one wakeup.
+ */
+int run_events(int timeout, int want_input) {
+    struct epoll_event evs[MAXEVENTS], ev;
+    int i, n, ready = 0;
+
+    if (want_input && !input_polled)
+        timeout = 0;
+    if (want_input && input_polled && !input_armed) {
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.u64 = EV_KEY(EV_INPUT, 0);
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, input.fd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        input_armed = 1;
+    }
+    do {
+        if ((n = epoll_wait(epfd, evs, MAXEVENTS, timeout)) < 0) {
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            n = 0;
+        }
+        for (i = 0; i < n; i++) {
+            switch (evs[i].data.u64 >> 32) {
+                case EV_SIGNAL:
+                    handle_signals();
+                    break;
+                case EV_INPUT:
+                    input_armed = 0;
+                    ready = 1;
+                    break;
+                case EV_PROC:
+                    reap_exited((pid_t)(uint32_t)evs[i].data.u64);
+                    break;
+                case EV_RELAY: {
+                    uint32_t id = (uint32_t)evs[i].data.u64;
+                    struct relay_t *r = relays[id >> 1];
+                    if (r == NULL)
+                        break;
+                    if ((id & 1) && (evs[i].events & EPOLLERR))
+                        relay_close(r);         /* the downstream stage is gone */
+                    else
+                        relay_pump(r);
+                    break;
+                }
+            }
+        }
+        if (jobs.nstate[QU] > 0)
+            admit_jobs();
+        note_flush();
+    } while (want_input && input_polled && !ready);
+    return ready;
+}
+ 
+/*
+ * handle_signals - Drain the signalfd. ctrl-c and ctrl-z are passed on
+ *     to the foreground job; SIGCHLD means some child stopped (exits
+ *     arrive on the pidfds).
+ */
+void handle_signals(void) {
+    struct signalfd_siginfo si[8];
+    ssize_t n;
+    pid_t pid;
+    int i;
+
+    while ((n = read(sigfd, si, sizeof(si))) > 0) {
+        for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+            if (trace_fd >= 0)
+                trace("i", "signal", trace_now(), 0, shell_pid, "\"signal\":%d",
+                      (int)si[i].ssi_signo);
+            switch (si[i].ssi_signo) {
+                case SIGCHLD:
+                    reap_stopped();
+                    break;
+                case SIGINT:
+                    if ((pid = fgpid(&jobs)) != 0)
+                        kill(-pid, SIGINT);
+                    else
+                        interrupted = 1;
+                    break;
+                case SIGTSTP:
+                    if ((pid = fgpid(&jobs)) != 0)
+                        kill(-pid, SIGTSTP);
+                    break;
+            }
+        }
+    }
+}
+ 
+/*
+ * reap_stopped - Collect the children that have stopped. Without
+ *     pidfds, collect the ones that have exited here as well.
+ */
+void reap_stopped(void) {
+    struct rusage ru;
+    siginfo_t si;
+    pid_t pid;
+    int status;
+
+    if (!pidfd_ok) {
+        while ((pid = wait4(-1, &status, WUNTRACED | WNOHANG, &ru)) > 0)
+            reapchild(pid, status, &ru);
+        return;
+    }
+    for (;;) {
+        si.si_pid = 0;
+        if (waitid(P_ALL, 0, &si, WSTOPPED | WNOHANG) < 0 || si.si_pid == 0)
+            break;
+        reapchild(si.si_pid, W_STOPCODE(si.si_status), NULL);
+    }
+}
+ 
+/*
+ * reap_exited - A child's pidfd became readable: it has exited. The
+ *     key is its pid, so an event for a process that is already gone
+ *     finds nothing on the job list and is ignored.
+ */
+void reap_exited(pid_t pid) {
+    struct rusage ru;
+    int status;
+
+    if (getproc(&jobs, pid) != NULL && wait4(pid, &status, WNOHANG, &ru) > 0)
+        reapchild(pid, status, &ru);
+}
+ 
+/*
+ * input_open - Set up to read commands from fd. A regular file is mapped
+ *     whole and split in place; anything else is read INPUTBUF bytes at
+ *     a time. Either way lines have no length limit.
+ */
+void input_open(int fd) {
+    struct stat st;
+    off_t off;
+    void *map;
+
+    input.fd = fd;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+        && (off = lseek(fd, 0, SEEK_CUR)) >= 0
+        && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        input.mapped = 1;
+        input.buf = map;
+        input.size = input.len = st.st_size;
+        input.pos = off < st.st_size ? off : st.st_size;
+        input.eof = 1;                  /* there is nothing more to read */
+        input.seekable = fd == STDIN_FILENO;
+        return;
+    }
+    input.size = INPUTBUF;
+    if ((input.buf = malloc(input.size)) == NULL)
+        unix_error("malloc error");
+}
+ 
+/*
+ * read_line - Return the next line of input, newline included, serving
+ *     events while none is available. Returns NULL at end of file.
+ *     The line stays valid until the next call.
+ */
+char *read_line(void) {
+    char *nl;
+    size_t n;
+
+    if (jobs.count > 0)
+        run_events(0, 0);               /* reap between buffered lines */
+    for (;;) {
+        nl = memchr(input.buf + input.pos + input.scanned, '\n',
+                    input.len - input.pos - input.scanned);
+        if (nl != NULL || (input.eof && input.pos < input.len)) {
+            n = (nl != NULL ? (size_t)(nl - input.buf) + 1 : input.len) - input.pos;
+            if (n + 1 > input.linesize) {
+                input.linesize = n + 1 > 2 * input.linesize ? n + 1 : 2 * input.linesize;
+                if ((input.line = realloc(input.line, input.linesize)) == NULL)
+                    unix_error("realloc error");
+            }
+            memcpy(input.line, input.buf + input.pos, n);
+            input.line[n] = '\0';
+            input.pos += n;
+            input.scanned = 0;
+            return input.line;
+        }
+        if (input.eof)
+            return NULL;
+        input.scanned = input.len - input.pos;
+        input_fill();
+    }
+}
+ 
+/*
+ * input_fill - Read more input into the buffer, serving events while
+ *     none is available. First drops what has been consumed, and grows
+ *     the buffer if the unconsumed part fills it.
+ */
+void input_fill(void) {
+    ssize_t got;
+
+    if (input.pos > 0) {
+        memmove(input.buf, input.buf + input.pos, input.len - input.pos);
+        input.len -= input.pos;
+        input.pos = 0;
+    }
+    if (input.len == input.size) {
+        input.size *= 2;
+        if ((input.buf = realloc(input.buf, input.size)) == NULL)
+            unix_error("realloc error");
+    }
+    run_events(-1, 1);
+    got = read(input.fd, input.buf + input.len, input.size - input.len);
+    if (got == 0)
+        input.eof = 1;
+    else if (got > 0)
+        input.len += got;
+    else if (errno != EINTR && errno != EAGAIN)
+        unix_error("read error");
+}
+ 
+/*
+ * read_heredoc - Read the input up to and including the next line that
+ *     is just delim (or up to end of file) and return a sealed memfd
+ *     holding the lines before it, or -1 on error. Whole lines are
+ *     written from the input buffer as they arrive, so a long body
+ *     never piles up in memory.
+ */
+int read_heredoc(const char *delim) {
+    int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    size_t dlen = strlen(delim), n;
+    const char *line, *nl = NULL, *end;
+    int found = 0;
+
+    for (;;) {
+        end = input.buf + input.len;
+        for (line = input.buf + input.pos; line < end; line = nl + 1) {
+            if ((nl = memchr(line, '\n', end - line)) == NULL) {
+                if (!input.eof)
+                    break;
+                nl = end - 1;           /* a last line with no newline */
+            }
+            if ((size_t)(nl - line) + (*nl != '\n') == dlen
+                && memcmp(line, delim, dlen) == 0) {
+                found = 1;
+                break;
+            }
+        }
+        n = line - (input.buf + input.pos);
+        if (n > 0 && fd >= 0 && write_all(fd, input.buf + input.pos, n) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        input.pos += n;
+        if (found)
+            input.pos += nl + 1 - line; /* the delimiter line */
+        if (found || input.eof)
+            break;
+        input_fill();
+    }
+    input.scanned = 0;
+    return fd >= 0 ? seal_memfd(fd) : -1;
+}
+ 
+/*
+ * input_sync - Called by run_pipeline for a stage that may read the
+ *     shell's stdin. When that is a mapped script, point its offset just
+ *     past the current line, so the command gets the rest of the script.
+ *     (Input read from a pipe is already in our buffer and can't be
+ *     given back.)
+ */
+void input_sync(void) {
+    if (!input.seekable || input.synced)
+        return;
+    if (lseek(input.fd, input.pos, SEEK_SET) < 0)
+        input.seekable = 0;
+    else
+        input.synced = 1;
+}
+ 
+/*
+ * input_resync - After a command line has run, carry on from wherever
+ *     its commands left the offset of a mapped stdin
+ */
+void input_resync(void) {
+    off_t off;
+
+    if (!input.synced)
+        return;
+    input.synced = 0;
+    if ((off = lseek(input.fd, 0, SEEK_CUR)) >= 0 && (size_t)off != input.pos)
+        input.pos = (size_t)off < input.len ? (size_t)off : input.len;
+}
+ 
+/* 
+ * reapchild - Update the job list for a child that wait4 reported,
+ *     keeping its resource usage ru (NULL for a stop). A job stops when
+ *     any of its processes stops, and it is done once every process
+ *     has been reaped; its status is the last stage's.
+ */
+void reapchild(pid_t pid, int status, const struct rusage *ru) {
+    struct proc_t *proc = getproc(&jobs, pid);
+    struct job_t *job;
+
+    if (proc == NULL)
+        return;
+    job = proc->job;
+    if (WIFSTOPPED(status)) {
+        if (trace_fd >= 0)
+            trace("i", "stop", trace_now(), 0, pid, "\"jid\":%d,\"signal\":%d",
+                  job->jid, WSTOPSIG(status));
+        if (job->state != ST) {
+            note_post(NOTE_STOP, job->jid, job->pid, WSTOPSIG(status));
+            setjobstate(&jobs, job, ST);
+        }
+        return;
+    }
+    /* A child whose exec failed exits 127, but so may any program: only
+     * drop the command's entry if its cached path is really gone */
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127 && proc->cmd[0] != '\0') {
+        struct hashent_t *ent = hash_find(proc->cmd);
+        if (ent != NULL && access(ent->path, X_OK) != 0)
+            hash_forget(proc->cmd);
+    }
+    proc->status = status;
+    clock_gettime(CLOCK_MONOTONIC, &proc->end);
+    if (ru != NULL)
+        proc->ru = *ru;
+    if (trace_fd >= 0)
+        trace("X", "run", trace_ts(&proc->start), elapsed(&proc->start, &proc->end) * 1e6,
+              pid, "\"jid\":%d,\"status\":%d", job->jid, status);
+    if (proc == job->last)
+        job->status = status;
+    reapproc(&jobs, proc);
+    if (--job->nlive > 0)
+        return;
+    if (WIFSIGNALED(job->status))
+        note_post(NOTE_KILL, job->jid, job->pid, WTERMSIG(job->status));
+    if (job->timed) {                   /* proc is the last one to go */
+        struct rusage total;
+        struct proc_t *p;
+        note_flush();                   /* the report follows the notice */
+        memset(&total, 0, sizeof(total));
+        for (p = job->procs; p != NULL; p = p->next)
+            ru_add(&total, &p->ru, 1);
+        reporttime(elapsed(&job->procs->start, &proc->end), &total);
+    }
+    if (job->relays != NULL) {
+        note_flush();
+        relay_report(job);
+    }
+    if (trace_fd >= 0)
+        trace("e", "job", trace_now(), 0, job->jid, "\"status\":%d", job->status);
+    if (job->task != NULL) {
+        job->task->status = job->status;
+        job->task->done = 1;
+        job->task->job = NULL;
+    }
+    removejob(&jobs, job);
+}
+
+/*
+ * note_post - Queue a job notification for the next note_flush. Only
+ *     the tail is written here and only the head in note_flush, so it
+ *     is safe to call from a signal handler. A full ring drops the
+ *     record and counts it.
+ */
+void note_post(int kind, int jid, pid_t pid, int sig) {
+    unsigned tail = __atomic_load_n(&note_tail, __ATOMIC_RELAXED);
+    struct note_t *n;
+
+    if (tail - __atomic_load_n(&note_head, __ATOMIC_ACQUIRE) >= NOTERING) {
+        __atomic_add_fetch(&note_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    n = &notes[tail & (NOTERING - 1)];
+    n->kind = kind;
+    n->jid = jid;
+    n->pid = pid;
+    n->sig = sig;
+    __atomic_store_n(&note_tail, tail + 1, __ATOMIC_RELEASE);
+}
+ 
+/*
+ * note_flush - Flush stdout, then print every queued notification (and
+ *     a count of any dropped since the last flush) with one writev.
+ *     Called from the main loop and the event loop, never a handler.
+ */
+void note_flush(void) {
+    static char text[NOTERING + 1][64];
+    struct iovec iov[NOTERING + 1], *v = iov;
+    unsigned head = note_head;
+    unsigned tail = __atomic_load_n(&note_tail, __ATOMIC_ACQUIRE);
+    unsigned long dropped = __atomic_load_n(&note_dropped, __ATOMIC_RELAXED);
+    int cnt = 0;
+    ssize_t n;
+
+    fflush(stdout);
+    if (head == tail && dropped == note_reported)
+        return;
+    for (; head != tail; head++, cnt++) {
+        struct note_t *note = &notes[head & (NOTERING - 1)];
+        iov[cnt].iov_base = text[cnt];
+        iov[cnt].iov_len = snprintf(text[cnt], sizeof(text[cnt]),
+                                    "Job [%d] (%d) %s by signal %d\n", note->jid,
+                                    note->pid, note->kind == NOTE_STOP
+                                    ? "stopped" : "terminated", note->sig);
+    }
+    __atomic_store_n(&note_head, head, __ATOMIC_RELEASE);
+    if (dropped != note_reported) {
+        iov[cnt].iov_base = text[cnt];
+        iov[cnt].iov_len = snprintf(text[cnt], sizeof(text[cnt]),
+                                    "%lu job notifications dropped\n",
+                                    dropped - note_reported);
+        cnt++;
+        note_reported = dropped;
+    }
+
+    /* Pick up after a short write */
+    while (cnt > 0) {
+        if ((n = writev(STDOUT_FILENO, v, cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (; cnt > 0 && (size_t)n >= v->iov_len; v++, cnt--)
+            n -= v->iov_len;
+        if (cnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+}
+
+/*********************
+ * End event loop
+ *********************/
+ 
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+ 
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nlive = 0;
+    job->status = 0;
+    job->procs = job->last = NULL;
+    job->timed = 0;
+    job->task = NULL;
+    job->place.set = 0;
+    job->relays = NULL;
+    job->docs = NULL;
+    if (job->cmdline != NULL)
+        job->cmdline[0] = '\0';
+    job->next = NULL;
+}
+ 
+/*
+ * growjobs - Make room for jids up to size-1 and keep the pid buckets
+ *     at least as many as the processes. Only called from addjob and
+ *     addproc.
+ */
+static void growjobs(struct jobtab_t *jobs, int size) {
+    int i;
+
+    if (size > jobs->size) {
+        int newsize = jobs->size * 2;
+        while (newsize < size)
+            newsize *= 2;
+        jobs->byjid = realloc(jobs->byjid, newsize * sizeof(*jobs->byjid));
+        jobs->freejids = realloc(jobs->freejids, newsize * sizeof(*jobs->freejids));
+        if (jobs->byjid == NULL || jobs->freejids == NULL)
+            unix_error("realloc error");
+        for (i = jobs->size; i < newsize; i++)
+            jobs->byjid[i] = NULL;
+        jobs->size = newsize;
+    }
+    if (jobs->nprocs >= jobs->nbuckets) {
+        int nbuckets = jobs->nbuckets * 2;
+        struct proc_t **bypid = calloc(nbuckets, sizeof(*bypid));
+        if (bypid == NULL)
+            unix_error("calloc error");
+        for (i = 0; i < jobs->nbuckets; i++) {
+            struct proc_t *proc, *next;
+            for (proc = jobs->bypid[i]; proc != NULL; proc = next) {
+                next = proc->hnext;
+                proc->hnext = bypid[proc->pid & (nbuckets - 1)];
+                bypid[proc->pid & (nbuckets - 1)] = proc;
+            }
+        }
+        free(jobs->bypid);
+        jobs->bypid = bypid;
+        jobs->nbuckets = nbuckets;
+    }
+}
+ 
+/* jid_push - Put a released jid on the free heap */
+static void jid_push(struct jobtab_t *jobs, int jid) {
+    int *heap = jobs->freejids, i;
+
+    for (i = jobs->nfree++; i > 0 && jid < heap[(i - 1) / 2]; i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];    /* sift up */
+    heap[i] = jid;
+}
+ 
+/* jid_pop - Take the lowest jid off the free heap, which is not empty */
+static int jid_pop(struct jobtab_t *jobs) {
+    int *heap = jobs->freejids, jid = heap[0], last, i, c;
+
+    last = heap[--jobs->nfree];
+    for (i = 0; (c = 2 * i + 1) < jobs->nfree; i = c) {    /* sift down */
+        if (c + 1 < jobs->nfree && heap[c + 1] < heap[c])
+            c++;
+        if (heap[c] >= last)
+            break;
+        heap[i] = heap[c];
+    }
+    heap[i] = last;
+    return jid;
+}
+ 
+/* initjobs - Initialize the job list */
+void initjobs(struct jobtab_t *jobs) {
+    memset(jobs, 0, sizeof(*jobs));
+    jobs->size = INITJOBS;
+    jobs->nbuckets = INITJOBS;
+    jobs->byjid = calloc(jobs->size, sizeof(*jobs->byjid));
+    jobs->freejids = calloc(jobs->size, sizeof(*jobs->freejids));
+    jobs->bypid = calloc(jobs->nbuckets, sizeof(*jobs->bypid));
+    if (jobs->byjid == NULL || jobs->freejids == NULL || jobs->bypid == NULL)
+        unix_error("calloc error");
+}
+ 
+/* freejid - Returns the job ID the next addjob will use */
+int freejid(struct jobtab_t *jobs) {
+    if (jobs->nfree > 0)
+        return jobs->freejids[0];       /* the lowest */
+    return jobs->maxjid + 1;
+}
+ 
+/*
+ * addjob - Add a job whose first process is pid to the job list (the
+ *     caller adds the process with addproc), or a queued job (state QU)
+ *     with no processes yet and pid 0. Returns the job's jid, 0 on
+ *     failure.
+ */
+int addjob(struct jobtab_t *jobs, pid_t pid, int state, char *cmdline) {
+    struct job_t *job;
+    size_t len;
+    int jid;
+    
+    if (pid < 1 && state != QU)
+        return 0;
+    growjobs(jobs, jobs->maxjid + 2);
+    if (jobs->nfree > 0)
+        jid = jid_pop(jobs);
+    else
+        jid = ++jobs->maxjid;
+
+    if ((job = jobs->spare) != NULL)
+        jobs->spare = job->next;
+    else if ((job = calloc(1, sizeof(*job))) == NULL)
+        unix_error("calloc error");
+    len = strlen(cmdline) + 1;
+    if (len > job->cmdsize) {
+        free(job->cmdline);
+        if ((job->cmdline = malloc(len)) == NULL)
+            unix_error("malloc error");
+        job->cmdsize = len;
+    }
+    memcpy(job->cmdline, cmdline, len);
+    job->pid = pid;
+    job->jid = jid;
+    job->state = UNDEF;
+    setjobstate(jobs, job, state);
+
+    jobs->byjid[jid] = job;
+    jobs->count++;
+    if (trace_fd >= 0) {
+        char line[TRACEBUF / 2];
+        trace("b", "job", trace_now(), 0, jid, "\"line\":%s",
+              json_str(line, sizeof(line), cmdline));
+    }
+    if(verbose){
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return jid;
+}
+ 
+/*
+ * addproc - Add process pid, started at *start (or now if start is NULL),
+ *     as the next pipeline stage of job
+ */
+int addproc(struct jobtab_t *jobs, struct job_t *job, pid_t pid,
+            const struct timespec *start) {
+    struct proc_t *proc;
+
+    if (pid < 1)
+        return 0;
+    growjobs(jobs, 0);
+    if ((proc = jobs->spareprocs) != NULL)
+        jobs->spareprocs = proc->hnext;
+    else if ((proc = malloc(sizeof(*proc))) == NULL)
+        unix_error("malloc error");
+    proc->pid = pid;
+    proc->reaped = 0;
+    proc->status = 0;
+    proc->job = job;
+    proc->pidfd = -1;
+    proc->cmd[0] = '\0';
+    if (start != NULL)
+        proc->start = *start;
+    else
+        clock_gettime(CLOCK_MONOTONIC, &proc->start);
+    memset(&proc->ru, 0, sizeof(proc->ru));
+#ifdef SYS_pidfd_open
+    if (pidfd_ok && (proc->pidfd = syscall(SYS_pidfd_open, pid, 0)) >= 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_KEY(EV_PROC, pid);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, proc->pidfd, &ev);
+    }
+#endif
+    if (proc->pidfd < 0)        /* fall back to reaping on SIGCHLD */
+        pidfd_ok = 0;
+    proc->next = NULL;
+    if (job->last != NULL)
+        job->last->next = proc;
+    else
+        job->procs = proc;
+    job->last = proc;
+    job->nlive++;
+
+    proc->hnext = jobs->bypid[pid & (jobs->nbuckets - 1)];
+    jobs->bypid[pid & (jobs->nbuckets - 1)] = proc;
+    jobs->nprocs++;
+    return 1;
+}
+ 
+/*
+ * reapproc - Mark a process reaped and stop watching it. It leaves the
+ *     pid hash so its pid can be reused, unless it is its job's first
+ *     process: getjobpid finds the job by that pid until removejob, and
+ *     the kernel won't reuse it while it names the job's process group.
+ *     The process stays on its job's list until the job is deleted.
+ */
+void reapproc(struct jobtab_t *jobs, struct proc_t *proc) {
+    proc->reaped = 1;
+    if (proc->pidfd >= 0) {
+        /* A forked shell stage may still hold a copy of the
+         * pidfd, so closing ours would not unregister it */
+        epoll_ctl(epfd, EPOLL_CTL_DEL, proc->pidfd, NULL);
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    }
+    if (proc != proc->job->procs)
+        unhashproc(jobs, proc);
+}
+ 
+/* unhashproc - Take a process out of the pid hash */
+void unhashproc(struct jobtab_t *jobs, struct proc_t *proc) {
+    struct proc_t **link = &jobs->bypid[proc->pid & (jobs->nbuckets - 1)];
+
+    for (; *link != NULL; link = &(*link)->hnext) {
+        if (*link == proc) {
+            *link = proc->hnext;
+            proc->hnext = NULL;
+            jobs->nprocs--;
+            return;
+        }
+    }
+}
+ 
+/* deletejob - Delete the job that process pid belongs to */
+int deletejob(struct jobtab_t *jobs, pid_t pid) {
+    struct job_t *job = getjobpid(jobs, pid);
+
+    if (job == NULL)
+        return 0;
+    removejob(jobs, job);
+    return 1;
+}
+ 
+/*
+ * removejob - Delete job from the job list. The entries go on the spare
+ *     lists rather than back to malloc, so a steady stream of jobs
+ *     doesn't keep calling it.
+ */
+void removejob(struct jobtab_t *jobs, struct job_t *job) {
+    struct proc_t *proc, *next;
+
+    relay_free(&job->relays);
+    docs_free(job->docs);
+    for (proc = job->procs; proc != NULL; proc = next) {
+        next = proc->next;
+        if (!proc->reaped)
+            reapproc(jobs, proc);
+        if (proc == job->procs)
+            unhashproc(jobs, proc);     /* see reapproc */
+        proc->hnext = jobs->spareprocs;
+        jobs->spareprocs = proc;
+    }
+    jobs->byjid[job->jid] = NULL;
+    jid_push(jobs, job->jid);
+    jobs->nstate[job->state]--;
+    if (jobs->fg == job)
+        jobs->fg = NULL;
+    if (--jobs->count == 0) {   /* start numbering from 1 again */
+        jobs->nfree = 0;
+        jobs->maxjid = 0;
+    }
+    clearjob(job);
+    job->next = jobs->spare;
+    jobs->spare = job;
+}
+ 
+/* setjobstate - Change a job's state, tracking the foreground job */
+void setjobstate(struct jobtab_t *jobs, struct job_t *job, int state) {
+    if (job == NULL)
+        return;
+    if (jobs->fg == job && state != FG)
+        jobs->fg = NULL;
+    if (state == FG)
+        jobs->fg = job;
+    if (job->state != UNDEF)
+        jobs->nstate[job->state]--;
+    jobs->nstate[state]++;
+    job->state = state;
+}
+ 
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct jobtab_t *jobs) {
+    return jobs->fg != NULL ? jobs->fg->pid : 0;
+}
+ 
+/* getproc - Find a live process (by PID) on the job list */
+struct proc_t *getproc(struct jobtab_t *jobs, pid_t pid) {
+    struct proc_t *proc;
+ 
+    if (pid < 1)
+        return NULL;
+    for (proc = jobs->bypid[pid & (jobs->nbuckets - 1)]; proc != NULL; proc = proc->hnext)
+        if (proc->pid == pid && !proc->reaped)
+            return proc;
+    return NULL;
+}
+ 
+/*
+ * getjobpid  - Find a job (by the PID of one of its live processes, or
+ *     of its first one) on the job list
+ */
+struct job_t *getjobpid(struct jobtab_t *jobs, pid_t pid) {
+    struct proc_t *proc;
+
+    if (pid < 1)
+        return NULL;
+    for (proc = jobs->bypid[pid & (jobs->nbuckets - 1)]; proc != NULL; proc = proc->hnext)
+        if (proc->pid == pid)           /* reaped: see reapproc */
+            return proc->job;
+    return NULL;
+}
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct jobtab_t *jobs, int jid) 
+{
+    if (jid < 1 || jid > jobs->maxjid)
+        return NULL;
+    return jobs->byjid[jid];
+}
+ 
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    struct job_t *job = getjobpid(&jobs, pid);
+
+    return job != NULL ? job->jid : 0;
+}
+ 
+/*
+ * listjobs - Print the job list. With longfmt, follow each job with a
+ *     line per process: its state, run time and, once it has been
+ *     reaped, the resources it used.
+ */
+void listjobs(struct jobtab_t *jobs, int longfmt) {
+    struct timespec now;
+    struct proc_t *proc;
+    int i;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 1; i <= jobs->maxjid; i++) {
+        struct job_t *job = jobs->byjid[i];
+        if (job != NULL) {
+            if (job->state == QU)       /* no pid until it starts */
+                printf("[%d] ", job->jid);
+            else
+                printf("[%d] (%d) ", job->jid, job->pid);
+            switch (job->state) {
+                case BG: 
+                    printf("Running ");
+                    break;
+                case FG: 
+                    printf("Foreground ");
+                    break;
+                case ST: 
+                    printf("Stopped ");
+                    break;
+                case QU: 
+                    printf("Queued ");
+                    break;
+                default:
+                    printf("listjobs: Internal error: job[%d].state=%d ", 
+                       i, job->state);
+            }
+            printf("%s", job->cmdline);
+            if (longfmt && job->place.set) {
+                char place[256];
+                printf("    placement %s\n", format_place(place, sizeof(place), &job->place));
+            }
+            for (proc = longfmt ? job->procs : NULL; proc != NULL; proc = proc->next) {
+                printf("    %6d ", proc->pid);
+                if (!proc->reaped) {
+                    printf("%-10s real %.3fs\n", job->state == ST ? "stopped" : "running",
+                           elapsed(&proc->start, &now));
+                    continue;
+                }
+                if (WIFSIGNALED(proc->status))
+                    printf("signal %-3d ", WTERMSIG(proc->status));
+                else
+                    printf("exit %-5d ", WEXITSTATUS(proc->status));
+                printf("real %.3fs user %.3fs sys %.3fs rss %ldK cs %ld/%ld flt %ld/%ld\n",
+                       elapsed(&proc->start, &proc->end),
+                       proc->ru.ru_utime.tv_sec + proc->ru.ru_utime.tv_usec / 1e6,
+                       proc->ru.ru_stime.tv_sec + proc->ru.ru_stime.tv_usec / 1e6,
+                       proc->ru.ru_maxrss, proc->ru.ru_nvcsw, proc->ru.ru_nivcsw,
+                       proc->ru.ru_minflt, proc->ru.ru_majflt);
+            }
+            if (longfmt)
+                relay_list(job);
+        }
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+ 
+ 
+/*****************************
+ * Admission queue routines
+ *****************************/
+ 
+/* qent_before - Does queue entry a start before b? */
+static int qent_before(const struct qent_t *a, const struct qent_t *b) {
+    return a->prio != b->prio ? a->prio > b->prio : a->seq < b->seq;
+}
+ 
+/* queue_job - Put queued job job on the admission queue */
+void queue_job(struct job_t *job, int prio) {
+    struct qent_t *heap, ent;
+    int i;
+
+    if (jobqueue.n == jobqueue.size) {
+        jobqueue.size = jobqueue.size ? 2 * jobqueue.size : INITJOBS;
+        if ((heap = realloc(jobqueue.heap, jobqueue.size * sizeof(*heap))) == NULL)
+            unix_error("realloc error");
+        jobqueue.heap = heap;
+    }
+    heap = jobqueue.heap;
+    ent.prio = prio;
+    ent.seq = job->seq = ++jobqueue.seq;
+    ent.job = job;
+    for (i = jobqueue.n++; i > 0 && qent_before(&ent, &heap[(i - 1) / 2]); i = (i - 1) / 2)
+        heap[i] = heap[(i - 1) / 2];    /* sift up */
+    heap[i] = ent;
+}
+ 
+/*
+ * queue_pop - Take the next job to start off the admission queue, or
+ *     NULL if none. Entries for jobs that were started by fg or bg (or
+ *     whose job_t has since been reused) are dropped on the way.
+ */
+struct job_t *queue_pop(void) {
+    struct qent_t *heap = jobqueue.heap, last;
     struct job_t *job;
-    if (id[0] == '%'){
-        int jid = strtol(id+1, NULL, 10);
-        if (jid == 0)
-        {
-            printf("%s: argument must be a PID or %%jid\n", argv[0]);
-            return;
+    int i, c;
+
+    while (jobqueue.n > 0) {
+        job = heap[0].job;
+        if (job->state != QU || job->seq != heap[0].seq)
+            job = NULL;
+        last = heap[--jobqueue.n];
+        for (i = 0; (c = 2 * i + 1) < jobqueue.n; i = c) {  /* sift down */
+            if (c + 1 < jobqueue.n && qent_before(&heap[c + 1], &heap[c]))
+                c++;
+            if (!qent_before(&heap[c], &last))
+                break;
+            heap[i] = heap[c];
         }
-        job = getjobjid(jobs, jid);
-        if(job == NULL){
-            printf("%s: No such job\n", id);
-            return;
+        heap[i] = last;
+        if (job != NULL)
+            return job;
+    }
+    return NULL;
+}
+ 
+/*
+ * admit_jobs - Start queued jobs while fewer than bg_limit background
+ *     jobs are running. Called from the event loop.
+ */
+void admit_jobs(void) {
+    struct job_t *job;
+
+    while ((bg_limit == 0 || jobs.nstate[BG] < bg_limit) && (job = queue_pop()) != NULL)
+        start_queued(job, BG);
+}
+ 
+/*
+ * start_queued - Start queued job job in state FG or BG. Its command
+ *     line is parsed again; the first parse is long gone. If nothing can
+ *     be started, the job is dropped.
+ */
+void start_queued(struct job_t *job, int state) {
+    static struct arena_t arena;
+    struct docs_t *docs;
+    struct pipeline_t *pl;
+    struct instage_t inshell;
+    const char *err;
+    int timed, prio;
+
+    if ((pl = parseline(job->cmdline, &arena, &err)) == NULL
+        || (pl = strip_prefixes(pl, &arena, &timed, &prio)) == NULL) {
+        removejob(&jobs, job);
+        arena_reset(&arena);
+        return;
+    }
+    pl = expand_globs(pl, &arena);
+    fflush(stdout);
+    docs = cmd_docs;
+    cmd_docs = job->docs;
+    run_pipeline(pl, state, job->cmdline, job, STDIN_FILENO, STDOUT_FILENO,
+                 &orig_mask, &inshell);
+    cmd_docs = docs;
+    docs_free(job->docs);               /* the stages have their copies */
+    job->docs = NULL;
+    if (inshell.argv != NULL)
+        run_instage(&inshell, job->state == QU ? NULL : job);
+    arena_reset(&arena);
+    if (job->state == QU) {             /* nothing was started */
+        removejob(&jobs, job);
+        return;
+    }
+    if (state == FG)
+        waitfg(job);
+    else
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+}
+ 
+/*
+ * strip_prefixes - Take the "time", "prio n" and "run [options]"
+ *     prefixes off the first stage of pl, setting *timed and *prio. The
+ *     parse may be cached, so a stripped pipeline is a copy in arena,
+ *     which also holds the placement. Returns NULL if there is nothing
+ *     left to run or a run option is bad.
+ */
+struct pipeline_t *strip_prefixes(struct pipeline_t *pl, struct arena_t *arena,
+                                  int *timed, int *prio) {
+    struct pipeline_t *copy;
+    struct place_t place;
+    char **argv = pl->stages[0].argv, **next;
+    char *end;
+    long n;
+    int skip = 0;
+
+    *timed = *prio = 0;
+    place.set = 0;
+    for (;;) {
+        if (argv[skip] != NULL && strcmp(argv[skip], "time") == 0) {
+            *timed = 1;
+            skip++;
+        } else if (argv[skip] != NULL && strcmp(argv[skip], "run") == 0) {
+            next = argv + skip + 1;
+            if (parse_place(&next, &place) < 0)
+                return NULL;
+            skip = next - argv;
+        } else if (argv[skip] != NULL && strcmp(argv[skip], "prio") == 0
+                   && argv[skip + 1] != NULL
+                   && (n = strtol(argv[skip + 1], &end, 10), end != argv[skip + 1])
+                   && *end == '\0') {
+            *prio = (int)n;
+            skip += 2;
+        } else
+            break;
+    }
+    if (skip == 0)
+        return pl;
+    if (argv[skip] == NULL) {
+        if (pl->nstages > 1)
+            printf("Invalid using of < > |\n");
+        return NULL;
+    }
+    copy = arena_alloc(arena, sizeof(*copy));
+    *copy = *pl;
+    copy->stages = arena_alloc(arena, pl->nstages * sizeof(struct stage_t));
+    memcpy(copy->stages, pl->stages, pl->nstages * sizeof(struct stage_t));
+    copy->stages[0].argv += skip;
+    copy->stages[0].argc -= skip;
+    if (place.set) {
+        copy->place = arena_alloc(arena, sizeof(place));
+        *copy->place = place;
+    }
+    return copy;
+}
+ 
+/*
+ * parse_place - Parse the options of a run prefix at *argvp into place,
+ *     leaving *argvp at the command:
+ *         --cpus list   run on these CPUs only (e.g. 0-3,8)
+ *         --nice n      at this nice value
+ *         --mem size    with this much address space (e.g. 2G)
+ *     Returns 0, or -1 after saying what was wrong.
+ */
+int parse_place(char ***argvp, struct place_t *place) {
+    char **argv = *argvp, *end;
+    long n;
+
+    for (; argv[0] != NULL && strncmp(argv[0], "--", 2) == 0; argv += 2) {
+        if (argv[1] == NULL) {
+            printf("run: %s requires an argument\n", argv[0]);
+            return -1;
+        }
+        if (strcmp(argv[0], "--cpus") == 0) {
+            if (parse_cpus(argv[1], &place->cpus) < 0) {
+                printf("run: %s: bad CPU list\n", argv[1]);
+                return -1;
+            }
+            place->set |= PLACE_CPUS;
+        } else if (strcmp(argv[0], "--nice") == 0) {
+            n = strtol(argv[1], &end, 10);
+            if (end == argv[1] || *end != '\0' || n < -20 || n > 19) {
+                printf("run: %s: nice value must be in [-20, 19]\n", argv[1]);
+                return -1;
+            }
+            place->nice = (int)n;
+            place->set |= PLACE_NICE;
+        } else if (strcmp(argv[0], "--mem") == 0) {
+            if (parse_size(argv[1], &place->mem) < 0) {
+                printf("run: %s: bad size\n", argv[1]);
+                return -1;
+            }
+            place->set |= PLACE_MEM;
+        } else {
+            printf("run: %s: unknown option\n", argv[0]);
+            return -1;
         }
     }
-    else if (strtol(id, NULL, 10)==0)
-    {
-        printf("%s: argument must be a PID or %%jid\n", argv[0]);
+    *argvp = argv;
+    return 0;
+}
+ 
+/*
+ * parse_cpus - Parse a CPU list like "0-3,8,10-11" into cpus. Returns 0,
+ *     or -1 if it is malformed, empty or names a CPU past CPU_SETSIZE.
+ */
+int parse_cpus(const char *str, cpu_set_t *cpus) {
+    const char *p = str;
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(cpus);
+    do {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, cpus);
+        p = end + 1;
+    } while (*end == ',');
+    return *end == '\0' && CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+ 
+/*
+ * format_place - Describe place in buf, e.g. "cpus 0-3,8 nice 10 mem
+ *     2048M". Returns buf.
+ */
+char *format_place(char *buf, size_t size, const struct place_t *place) {
+    size_t len = 0;
+    int cpu, last;
+
+    buf[0] = '\0';
+    if (place->set & PLACE_CPUS) {
+        len += snprintf(buf + len, size - len, "cpus ");
+        for (cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+            if (!CPU_ISSET(cpu, &place->cpus))
+                continue;
+            for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &place->cpus); last++)
+                ;
+            if (last > cpu)
+                len += snprintf(buf + len, size - len, "%d-%d,", cpu, last);
+            else
+                len += snprintf(buf + len, size - len, "%d,", cpu);
+            cpu = last;
+        }
+        if (len < size)
+            buf[--len] = '\0';         /* the last comma */
+    }
+    if ((place->set & PLACE_NICE) && len < size)
+        len += snprintf(buf + len, size - len, "%snice %d", len ? " " : "", place->nice);
+    if ((place->set & PLACE_MEM) && len < size)
+        snprintf(buf + len, size - len, "%smem %ldM", len ? " " : "", place->mem >> 20);
+    return buf;
+}
+ 
+/*
+ * place_apply - Called in a child before it execs: apply its job's
+ *     placement to itself. Returns 0, or -1 after saying what failed.
+ */
+int place_apply(const struct place_t *place) {
+    struct rlimit rl;
+
+    if ((place->set & PLACE_CPUS)
+        && sched_setaffinity(0, sizeof(place->cpus), &place->cpus) < 0) {
+        perror("run: sched_setaffinity");
+        return -1;
+    }
+    if ((place->set & PLACE_NICE) && setpriority(PRIO_PROCESS, 0, place->nice) < 0) {
+        perror("run: setpriority");
+        return -1;
+    }
+    if (place->set & PLACE_MEM) {
+        rl.rlim_cur = rl.rlim_max = place->mem;
+        if (setrlimit(RLIMIT_AS, &rl) < 0) {
+            perror("run: setrlimit");
+            return -1;
+        }
+    }
+    return 0;
+}
+ 
+/*********************************
+ * end admission queue routines
+ *********************************/
+ 
+ 
+/*****************************
+ * Resource accounting routines
+ *****************************/
+ 
+/* elapsed - Seconds from one CLOCK_MONOTONIC reading to another */
+double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+ 
+/*
+ * ru_add - Add (sign > 0) or subtract (sign < 0) src's times and counts
+ *     to dst. Max RSS is a peak, so it is only ever raised.
+ */
+void ru_add(struct rusage *dst, const struct rusage *src, int sign) {
+    long long usec;
+
+    usec = dst->ru_utime.tv_sec * 1000000LL + dst->ru_utime.tv_usec
+         + sign * (src->ru_utime.tv_sec * 1000000LL + src->ru_utime.tv_usec);
+    dst->ru_utime.tv_sec = usec / 1000000;
+    dst->ru_utime.tv_usec = usec % 1000000;
+    usec = dst->ru_stime.tv_sec * 1000000LL + dst->ru_stime.tv_usec
+         + sign * (src->ru_stime.tv_sec * 1000000LL + src->ru_stime.tv_usec);
+    dst->ru_stime.tv_sec = usec / 1000000;
+    dst->ru_stime.tv_usec = usec % 1000000;
+    if (sign > 0 && src->ru_maxrss > dst->ru_maxrss)
+        dst->ru_maxrss = src->ru_maxrss;
+    dst->ru_nvcsw += sign * src->ru_nvcsw;
+    dst->ru_nivcsw += sign * src->ru_nivcsw;
+    dst->ru_minflt += sign * src->ru_minflt;
+    dst->ru_majflt += sign * src->ru_majflt;
+}
+ 
+/* ru_now - Resources used so far by the shell and its reaped children */
+void ru_now(struct rusage *ru) {
+    struct rusage children;
+
+    getrusage(RUSAGE_SELF, ru);
+    getrusage(RUSAGE_CHILDREN, &children);
+    ru_add(ru, &children, 1);
+}
+ 
+/* reporttime - Print the report of the time builtin */
+void reporttime(double real, const struct rusage *ru) {
+    printf("real\t%.3fs\n", real);
+    printf("user\t%.3fs\n", ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6);
+    printf("sys\t%.3fs\n", ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6);
+    printf("rss\t%ldK\n", ru->ru_maxrss);
+    printf("csw\t%ld voluntary, %ld involuntary\n", ru->ru_nvcsw, ru->ru_nivcsw);
+    printf("faults\t%ld minor, %ld major\n", ru->ru_minflt, ru->ru_majflt);
+}
+ 
+/*
+ * reportsince - Print the time report for work the shell did itself (a
+ *     builtin or a shell stage) since t0, when ru_now returned ru0
+ */
+void reportsince(const struct timespec *t0, const struct rusage *ru0) {
+    struct timespec t1;
+    struct rusage ru;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ru_now(&ru);
+    ru_add(&ru, ru0, -1);
+    reporttime(elapsed(t0, &t1), &ru);
+}
+/*********************************
+ * end resource accounting routines
+ *********************************/
+ 
+ 
+/*****************************
+ * Pipe meter routines
+ *****************************/
+ 
+/*
+ * relay_open - Meter the pipe whose read end is in (-m): make a second
+ *     pipe for the downstream stage to read, and leave the event loop to
+ *     splice from one to the other, counting bytes and timing the waits.
+ *     The relay goes on the end of *list. Returns the read end for the
+ *     downstream stage, which is in itself if no relay could be set up.
+ */
+int relay_open(struct relay_t **list, int in, int stage, const char *from,
+               const char *to, long size) {
+    struct epoll_event ev;
+    struct relay_t *r;
+    int pfd[2], slot;
+
+    if (pipe2(pfd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return in;
+    }
+    if (size > 0)
+        size_pipe(pfd[1], size);
+    for (slot = 0; slot < nrelays && relays[slot] != NULL; slot++)
+        ;
+    if (slot == nrelays) {
+        nrelays = nrelays > 0 ? 2 * nrelays : 16;
+        if ((relays = realloc(relays, nrelays * sizeof(*relays))) == NULL)
+            unix_error("realloc error");
+        memset(relays + slot, 0, (nrelays - slot) * sizeof(*relays));
+    }
+    if ((r = calloc(1, sizeof(*r))) == NULL || (r->from = strdup(from)) == NULL
+        || (r->to = strdup(to)) == NULL)
+        unix_error("malloc error");
+    r->in = in;
+    r->out = pfd[1];
+    r->slot = slot;
+    r->stage = stage;
+    r->state = RELAY_WAIT_IN;           /* until the first bytes come */
+    r->events = EPOLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    r->since = r->win = r->start;
+    fcntl(r->in, F_SETFL, fcntl(r->in, F_GETFL) | O_NONBLOCK);
+    fcntl(r->out, F_SETFL, fcntl(r->out, F_GETFL) | O_NONBLOCK);
+
+    /* One id per end: an error on the write end means no reader */
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_KEY(EV_RELAY, slot << 1);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, r->in, &ev);
+    ev.events = 0;
+    ev.data.u64 = EV_KEY(EV_RELAY, slot << 1 | 1);
+    epoll_ctl(epfd, EPOLL_CTL_ADD, r->out, &ev);
+    relays[slot] = r;
+    live_relays++;
+
+    while (*list != NULL)
+        list = &(*list)->next;
+    *list = r;
+    return pfd[0];
+}
+ 
+/*
+ * relay_pump - Splice what relay r can, then note which side it is
+ *     waiting for and watch that one. Gives up the event loop after a
+ *     few chunks so one fast pipe can't starve the rest.
+ */
+void relay_pump(struct relay_t *r) {
+    struct timespec now;
+    ssize_t n = 0;
+    int avail, k;
+
+    if (r->state == RELAY_DONE)
         return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (r->state == RELAY_WAIT_IN)
+        r->wait_in += elapsed(&r->since, &now);
+    else if (r->state == RELAY_WAIT_OUT)
+        r->wait_out += elapsed(&r->since, &now);
+    r->since = now;
+
+    for (k = 0; k < 16; k++) {
+        n = splice(r->in, NULL, r->out, NULL, COPYCHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            r->bytes += n;
+        else if (n == 0 || errno != EINTR)
+            break;
     }
-    else if (strtol(id, NULL, 10)>0)
-    {
-        pid_t pid = strtol(id, NULL, 10);
-        job = getjobpid(jobs, pid);
-        if (job == NULL)
-        {
-            printf("(%s): No such process\n", id);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        relay_close(r);                 /* end of data, or EPIPE */
+        return;
+    }
+    if (n > 0)
+        r->state = RELAY_RUN;
+    else if (ioctl(r->in, FIONREAD, &avail) == 0 && avail > 0)
+        r->state = RELAY_WAIT_OUT;
+    else
+        r->state = RELAY_WAIT_IN;
+    relay_watch(r, r->state == RELAY_WAIT_IN ? EPOLLIN
+                 : r->state == RELAY_WAIT_OUT ? EPOLLOUT : EPOLLIN | EPOLLOUT);
+
+    if (elapsed(&r->win, &now) >= 1.0) {
+        r->rate = (r->bytes - r->win_bytes) / elapsed(&r->win, &now);
+        r->win = now;
+        r->win_bytes = r->bytes;
+    }
+}
+ 
+/* relay_watch - Ask the event loop for events (EPOLLIN for in, EPOLLOUT for out) */
+void relay_watch(struct relay_t *r, int events) {
+    struct epoll_event ev;
+
+    if ((events ^ r->events) & EPOLLIN) {
+        ev.events = events & EPOLLIN;
+        ev.data.u64 = EV_KEY(EV_RELAY, r->slot << 1);
+        epoll_ctl(epfd, EPOLL_CTL_MOD, r->in, &ev);
+    }
+    if ((events ^ r->events) & EPOLLOUT) {
+        ev.events = events & EPOLLOUT;
+        ev.data.u64 = EV_KEY(EV_RELAY, r->slot << 1 | 1);
+        epoll_ctl(epfd, EPOLL_CTL_MOD, r->out, &ev);
+    }
+    r->events = events;
+}
+ 
+/*
+ * relay_close - Stop relay r, closing both its pipes: the downstream
+ *     stage sees end of file, the upstream one EPIPE. Its counts stay
+ *     for the job's report.
+ */
+void relay_close(struct relay_t *r) {
+    struct timespec now;
+
+    if (r->state == RELAY_DONE)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (r->state == RELAY_WAIT_IN)
+        r->wait_in += elapsed(&r->since, &now);
+    else if (r->state == RELAY_WAIT_OUT)
+        r->wait_out += elapsed(&r->since, &now);
+    r->since = now;                     /* now the end time */
+    r->state = RELAY_DONE;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, r->in, NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, r->out, NULL);
+    close(r->in);
+    close(r->out);
+    r->in = r->out = -1;
+    relays[r->slot] = NULL;
+    live_relays--;
+}
+ 
+/* relay_free - Close and free a list of relays */
+void relay_free(struct relay_t **list) {
+    struct relay_t *r, *next;
+
+    for (r = *list; r != NULL; r = next) {
+        next = r->next;
+        relay_close(r);
+        free(r->from);
+        free(r->to);
+        free(r);
+    }
+    *list = NULL;
+}
+ 
+/*
+ * relay_waits - Relay r's waits for input and output so far, counting
+ *     the one it is in up to now
+ */
+void relay_waits(const struct relay_t *r, const struct timespec *now,
+                 double *wait_in, double *wait_out) {
+    *wait_in = r->wait_in;
+    *wait_out = r->wait_out;
+    if (r->state == RELAY_WAIT_IN)
+        *wait_in += elapsed(&r->since, now);
+    else if (r->state == RELAY_WAIT_OUT)
+        *wait_out += elapsed(&r->since, now);
+}
+ 
+/*
+ * relay_slowest - The stage holding a job's metered pipeline up, NULL
+ *     if none is. A stage holds it up when the pipe into it backs up
+ *     (its relay waits for output) and the pipe out of it runs dry (the
+ *     relay waits for input), beyond what its neighbours' pipes show;
+ *     the stage with the largest such excess is named.
+ */
+const char *relay_slowest(struct job_t *job, const struct timespec *now) {
+    struct relay_t *r, *up;
+    const char *slowest = NULL;
+    double best = 0.001, score;         /* less isn't holding anything up */
+    double in, out, up_in = 0, up_out = 0;
+
+    for (r = job->relays, up = NULL; r != NULL; up = r, r = r->next) {
+        relay_waits(r, now, &in, &out);
+        if (up != NULL && up->stage + 1 != r->stage)
+            up = NULL;                  /* a new pipeline (a <(cmd)) */
+        score = in - out;
+        if (up != NULL)
+            score += up_out - up_in;
+        if (score > best) {
+            best = score;
+            slowest = r->from;
+        }
+        if (r->next == NULL || r->next->stage != r->stage + 1) {
+            score = out - in;           /* the last stage */
+            if (score > best) {
+                best = score;
+                slowest = r->to;
+            }
+        }
+        up_in = in;
+        up_out = out;
+    }
+    return slowest;
+}
+ 
+/*
+ * relay_list - Print a job's metered pipes for jobs -l: bytes so far,
+ *     the rate over the last second (the average once done), the time
+ *     spent waiting on each side and the slowest stage so far
+ */
+void relay_list(struct job_t *job) {
+    char bytes[32], rate[32];
+    struct timespec now;
+    struct relay_t *r;
+    const char *slowest;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (r = job->relays; r != NULL; r = r->next) {
+        double wait_in, wait_out;
+        double t = elapsed(&r->start, r->state == RELAY_DONE ? &r->since : &now);
+        relay_waits(r, &now, &wait_in, &wait_out);
+        printf("    meter %s -> %s: %s, %s/s%s, waited for input %.3fs, output %.3fs\n",
+               r->from, r->to, format_bytes(bytes, sizeof(bytes), r->bytes),
+               format_bytes(rate, sizeof(rate),
+                            r->state != RELAY_DONE && r->win_bytes > 0 ? r->rate
+                            : t > 0 ? r->bytes / t : 0),
+               r->state == RELAY_DONE ? " done" : "", wait_in, wait_out);
+    }
+    if ((slowest = relay_slowest(job, &now)) != NULL)
+        printf("    slowest stage: %s\n", slowest);
+}
+ 
+/*
+ * relay_report - Print the meter summary of a finished job: each pipe's
+ *     bytes, average rate and waits, and the slowest stage
+ */
+void relay_report(struct job_t *job) {
+    char bytes[32], rate[32];
+    struct timespec now;
+    struct relay_t *r;
+    const char *slowest;
+    double t;
+
+    for (r = job->relays; r != NULL; r = r->next) {
+        t = elapsed(&r->start, &r->since);
+        printf("Job [%d] meter %s -> %s: %s, %s/s, waited for input %.3fs, output %.3fs\n",
+               job->jid, r->from, r->to, format_bytes(bytes, sizeof(bytes), r->bytes),
+               format_bytes(rate, sizeof(rate), t > 0 ? r->bytes / t : 0),
+               r->wait_in, r->wait_out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((slowest = relay_slowest(job, &now)) != NULL)
+        printf("Job [%d] slowest stage: %s\n", job->jid, slowest);
+}
+/*********************************
+ * end pipe meter routines
+ *********************************/
+ 
+ 
+/*********************************************
+ * Helper routines for the command hash table
+ *********************************************/
+ 
+/* hash_name - Hash a command name into a bucket index */
+unsigned hash_name(const char *name) {
+    unsigned h = 5381;
+
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    return h % HASHSIZE;
+}
+ 
+/* hash_find - Find the cache entry for name, NULL if there is none */
+struct hashent_t *hash_find(const char *name) {
+    struct hashent_t *ent;
+
+    for (ent = cmdhash[hash_name(name)]; ent != NULL; ent = ent->next)
+        if (strcmp(ent->name, name) == 0)
+            return ent;
+    return NULL;
+}
+ 
+/*
+ * hash_lookup - Return the full path of command name, searching PATH
+ *     only on the first use. Names containing a slash are returned as is.
+ *     The table is dropped when PATH changes (see env_changed); an entry
+ *     whose path has gone is dropped when its exec fails (see
+ *     reapchild). Returns NULL if name is not found.
+ */
+char *hash_lookup(const char *name) {
+    const char *pathenv = env_get("PATH");
+    struct hashent_t *ent;
+    char *path;
+
+    if (strchr(name, '/') != NULL)
+        return (char *)name;
+    if ((ent = hash_find(name)) != NULL) {
+        ent->hits++;
+        return ent->path;
+    }
+    if ((path = path_search(name, pathenv != NULL ? pathenv : DEFPATH)) != NULL) {
+        unsigned h = hash_name(name);
+        if ((ent = malloc(sizeof(*ent))) == NULL)
+            unix_error("malloc error");
+        ent->name = strdup(name);
+        ent->path = path;
+        ent->hits = 1;
+        ent->next = cmdhash[h];
+        cmdhash[h] = ent;
+    }
+    return path;
+}
+ 
+/*
+ * path_search - Look for an executable name in the directories of
+ *     pathenv. Returns its path in a malloc'd buffer, or NULL.
+ */
+char *path_search(const char *name, const char *pathenv) {
+    struct stat st;
+    char *buf;
+    size_t namelen = strlen(name);
+
+    buf = malloc(strlen(pathenv) + namelen + 3);
+    if (buf == NULL)
+        unix_error("malloc error");
+    while (1) {
+        const char *end = strchr(pathenv, ':');
+        size_t dirlen = end ? (size_t)(end - pathenv) : strlen(pathenv);
+
+        if (dirlen == 0) {                  /* empty entry means "." */
+            strcpy(buf, ".");
+            dirlen = 1;
+        } else
+            memcpy(buf, pathenv, dirlen);
+        buf[dirlen] = '/';
+        memcpy(buf + dirlen + 1, name, namelen + 1);
+        if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0)
+            return buf;
+        if (end == NULL)
+            break;
+        pathenv = end + 1;
+    }
+    free(buf);
+    return NULL;
+}
+ 
+/*
+ * path_lookup - hash_lookup for a command run with environment envp.
+ *     Only a "PATH=dir ..." of its own bypasses the table; that search
+ *     is not cached. The path is valid until the command line is done.
+ */
+char *path_lookup(const char *name, char **envp) {
+    char *pathvar = NULL, *path, **p;
+    struct envvar_t *var;
+
+    if (envp == env_block || strchr(name, '/') != NULL)
+        return hash_lookup(name);
+    for (p = envp; *p != NULL; p++)
+        if (strncmp(*p, "PATH=", 5) == 0)
+            pathvar = *p;
+    var = *env_find("PATH", 4);
+    if (pathvar == (var != NULL ? var->str : NULL))     /* not overridden */
+        return hash_lookup(name);
+    path = path_search(name, pathvar != NULL ? pathvar + 5 : DEFPATH);
+    if (path != NULL) {
+        char *copy = arena_strndup(&cmd_arena, path, strlen(path));
+        free(path);
+        path = copy;
+    }
+    return path;
+}
+ 
+/* hash_forget - Drop the cache entry for name, if any */
+void hash_forget(const char *name) {
+    struct hashent_t **link = &cmdhash[hash_name(name)];
+    struct hashent_t *ent;
+
+    for (; (ent = *link) != NULL; link = &ent->next) {
+        if (strcmp(ent->name, name) == 0) {
+            *link = ent->next;
+            free(ent->name);
+            free(ent->path);
+            free(ent);
             return;
         }
     }
-    else{
-    printf("No such job\n");
-    return;}
-    if (strcmp(argv[0], "bg")==0 && job->state == ST)
-    {
-        kill(job->pid, SIGCONT);
-        job->state = BG;
-        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
-        return;
+}
+ 
+/* hash_clear - Empty the command hash table */
+void hash_clear(void) {
+    int i;
+    struct hashent_t *ent, *next;
+
+    for (i = 0; i < HASHSIZE; i++) {
+        for (ent = cmdhash[i]; ent != NULL; ent = next) {
+            next = ent->next;
+            free(ent->name);
+            free(ent->path);
+            free(ent);
+        }
+        cmdhash[i] = NULL;
+    }
+}
+/**********************************
+ * end command hash helper routines
+ **********************************/
+ 
+ 
+/**********************************
+ * Environment routines
+ *
+ * Variables live in a hash table of "NAME=value" strings. env_block
+ * is a NULL-terminated array of those same strings, built on the first
+ * launch after a change and then handed to every execve as it is, so
+ * starting a command costs nothing per variable. A command with its
+ * own NAME=value words gets a copy of the array in the arena with
+ * those entries swapped; the table is never touched.
+ **********************************/
+ 
+/* env_init - Fill the table from the environment the shell was given */
+void env_init(void) {
+    char **p;
+
+    for (p = environ; *p != NULL; p++)
+        if (env_namelen(*p) > 0)
+            env_set(*p);
+}
+ 
+/* env_isname - Is str[0..len) a variable name (letters, digits and _)? */
+int env_isname(const char *str, size_t len) {
+    size_t i;
+
+    if (len == 0 || isdigit((unsigned char)str[0]))
+        return 0;
+    for (i = 0; i < len; i++)
+        if (!isalnum((unsigned char)str[i]) && str[i] != '_')
+            return 0;
+    return 1;
+}
+ 
+/*
+ * env_namelen - Length of NAME if str starts with NAME=, else 0. Also
+ *     used on raw command line text, where a quote or backslash before
+ *     the = makes the word an ordinary argument.
+ */
+size_t env_namelen(const char *str) {
+    size_t n = 0;
+
+    if (isdigit((unsigned char)*str))
+        return 0;
+    while (isalnum((unsigned char)str[n]) || str[n] == '_')
+        n++;
+    return n > 0 && str[n] == '=' ? n : 0;
+}
+ 
+/* env_hash - Hash a variable name into a bucket index */
+unsigned env_hash(const char *name, size_t len) {
+    unsigned h = 5381;
+
+    while (len-- > 0)
+        h = h * 33 + (unsigned char)*name++;
+    return h % ENVHASH;
+}
+ 
+/* env_find - The link to the entry for name[0..len), which is NULL if
+ *     there is none */
+struct envvar_t **env_find(const char *name, size_t len) {
+    struct envvar_t **link = &envtab[env_hash(name, len)];
+
+    for (; *link != NULL; link = &(*link)->next)
+        if ((*link)->namelen == len && strncmp((*link)->str, name, len) == 0)
+            break;
+    return link;
+}
+ 
+/* env_get - The value of variable name, NULL if it is not set */
+char *env_get(const char *name) {
+    size_t len = strlen(name);
+    struct envvar_t *var = *env_find(name, len);
+
+    return var != NULL ? var->str + len + 1 : NULL;
+}
+ 
+/* env_set - Set a variable from str, which is NAME=value */
+void env_set(const char *str) {
+    size_t len = env_namelen(str);
+    struct envvar_t **link = env_find(str, len), *var = *link;
+    char *copy;
+
+    if (var != NULL && strcmp(var->str, str) == 0)
+        return;                         /* no change */
+    if ((copy = strdup(str)) == NULL)
+        unix_error("strdup error");
+    if (var != NULL) {
+        free(var->str);
+        var->str = copy;
+    } else {
+        if ((var = malloc(sizeof(*var))) == NULL)
+            unix_error("malloc error");
+        var->str = copy;
+        var->namelen = len;
+        var->next = NULL;
+        *link = var;
+        env_count++;
     }
-    else if (strcmp(argv[0], "fg")==0 && job->state != FG){
-        kill(-job->pid, SIGCONT);
-        job->state = FG;
-        waitfg(job->pid);
-        return;
-        }
-    return;
-    
+    env_changed(str, len);
+}
  
+/* env_unset - Remove variable name, if it is set */
+void env_unset(const char *name) {
+    size_t len = strlen(name);
+    struct envvar_t **link = env_find(name, len), *var = *link;
+
+    if (var == NULL)
+        return;
+    *link = var->next;
+    free(var->str);
+    free(var);
+    env_count--;
+    env_changed(name, len);
 }
  
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+/*
+ * env_changed - Note that variable name[0..len) changed: env_block is
+ *     built again on its next use, idle zygotes are replaced, and a new
+ *     PATH empties the command hash table.
  */
-void waitfg(pid_t pid) {
-    int status;
-    struct job_t *job;
+void env_changed(const char *name, size_t len) {
+    free(env_block);
+    env_block = NULL;
+    env_gen++;
+    if (len == 4 && strncmp(name, "PATH", 4) == 0)
+        hash_clear();
+}
  
-    if (pid != 0) {
-        // Wait for foreground job to terminate
-        while (waitpid(pid, &status, WUNTRACED) > 0) {
-            if (WIFSTOPPED(status)) {
-                // Job stopped by signal
-                job = getjobpid(jobs, pid);
-                job->state = ST;
-                return;
-            }
-            deletejob(jobs, pid); // Delete the job after reaping
-        }
+/* env_envp - The envp for commands with no NAME=value words of their own */
+char **env_envp(void) {
+    struct envvar_t *var;
+    int i, n = 0;
+
+    if (env_block != NULL)
+        return env_block;
+    if ((env_block = malloc((env_count + 1) * sizeof(char *))) == NULL)
+        unix_error("malloc error");
+    for (i = 0; i < ENVHASH; i++)
+        for (var = envtab[i]; var != NULL; var = var->next)
+            env_block[n++] = var->str;
+    env_block[n] = NULL;
+    return env_block;
+}
+ 
+/* env_cmp - Order two NAME=value strings by name, for qsort */
+int env_cmp(const void *a, const void *b) {
+    const unsigned char *p = *(const unsigned char **)a;
+    const unsigned char *q = *(const unsigned char **)b;
+
+    for (; *p == *q && *p != '='; p++, q++)
+        ;
+    return (*p == '=' ? 0 : *p) - (*q == '=' ? 0 : *q);
+}
+ 
+/*
+ * env_overlay - Copy env_block into arena with the n NAME=value strings
+ *     of assigns in place of the variables they name; the strings
+ *     themselves are shared. The last of two assignments to a name wins.
+ */
+char **env_overlay(char **assigns, int n, struct arena_t *arena) {
+    char **base = env_envp();
+    char **envp = arena_alloc(arena, (env_count + n + 1) * sizeof(char *));
+    int i, j, k = 0;
+
+    for (; *base != NULL; base++) {
+        size_t len = strchr(*base, '=') - *base + 1;
+        for (i = 0; i < n && strncmp(*base, assigns[i], len) != 0; i++)
+            ;
+        if (i == n)
+            envp[k++] = *base;
     }
+    for (i = 0; i < n; i++) {
+        size_t len = env_namelen(assigns[i]) + 1;
+        for (j = i + 1; j < n && strncmp(assigns[i], assigns[j], len) != 0; j++)
+            ;
+        if (j == n)
+            envp[k++] = assigns[i];
+    }
+    envp[k] = NULL;
+    return envp;
+}
+ 
+/*
+ * skip_assigns - Step argv, a stage's arguments (maybe with a prefix
+ *     taken off), past its leading NAME=value words. They are told apart
+ *     from arguments that merely look like one by their argv slot.
+ */
+char **skip_assigns(const struct stage_t *st, char **argv) {
+    struct assign_t *a;
 
+    for (; *argv != NULL; argv++) {
+        for (a = st->assigns; a != NULL && a->word != *argv; a = a->next)
+            ;
+        if (a == NULL)
+            break;
+    }
+    return argv;
+}
+ 
+/*
+ * stage_env - Split stage st's arguments argv into its NAME=value words
+ *     and its command: sets *envpp to the environment to run it with and
+ *     returns the command's argv, whose [0] is NULL if there is none.
+ */
+char **stage_env(const struct stage_t *st, char **argv, char ***envpp,
+                 struct arena_t *arena) {
+    char **words = st->assigns != NULL ? skip_assigns(st, argv) : argv;
 
+    if (words == argv)
+        *envpp = env_envp();
+    else
+        *envpp = env_overlay(argv, words - argv, arena);
+    return words;
 }
+/**********************************
+ * end environment routines
+ **********************************/
  
  
-/*****************
- * Signal handlers
- *****************/
+/*****************************
+ * Arena allocator routines
+ *****************************/
  
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/*
+ * arena_alloc - Hand out size bytes (16-byte aligned) from arena, adding
+ *     a block when the current one is full. Never returns NULL.
  */
-void sigchld_handler(int sig) {
-    pid_t pid;
-    int status;
-    
-    while ((pid = waitpid(-1, &status, WUNTRACED | WNOHANG)) > 0) {
-        if (WIFEXITED(status)) {
-            // Child process terminated normally
-            deletejob(jobs, pid);
-        } else if (WIFSIGNALED(status)) {
-            // Child process terminated by a signal
-            printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, WTERMSIG(status));
-            deletejob(jobs, pid);
-        } else if (WIFSTOPPED(status)) {
-            // Child process stopped by a signal
-            printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, WSTOPSIG(status));
-            struct job_t *job = getjobpid(jobs, pid);
-            job->state = ST;
-        }
-    }
+void *arena_alloc(struct arena_t *arena, size_t size) {
+    struct arenablk_t *blk = arena->blk;
+    void *p;
 
+    size = (size + 15) & ~(size_t)15;
+    if (blk == NULL || blk->size - blk->used < size) {
+        size_t bsize = size > ARENABLOCK ? size : ARENABLOCK;
+        if ((blk = malloc(sizeof(*blk) + bsize)) == NULL)
+            unix_error("malloc error");
+        blk->size = bsize;
+        blk->used = 0;
+        blk->next = arena->blk;
+        arena->blk = blk;
+    }
+    p = blk->data + blk->used;
+    blk->used += size;
+    arena->bytes += size;
+    return p;
 }
+ 
+/* arena_strndup - Copy len bytes of str into arena as a C string */
+char *arena_strndup(struct arena_t *arena, const char *str, size_t len) {
+    char *p = arena_alloc(arena, len + 1);
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenever the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+    memcpy(p, str, len);
+    p[len] = '\0';
+    return p;
+}
+ 
+/*
+ * arena_grow - Move the first used bytes at old, from arena, to a new
+ *     allocation of size bytes. The old space comes back at the reset.
  */
-void sigint_handler(int sig) {
-    pid_t pid = fgpid(jobs);
-    if (pid != 0){
-        struct job_t *job = getjobpid(jobs, pid);
-        printf("Job [%d] (%d) terminated by signal 2\n", job->jid, job->pid);
-        kill(-pid, SIGINT);
-        deletejob(jobs, pid);
-    }
+void *arena_grow(struct arena_t *arena, void *old, size_t used, size_t size) {
+    void *p = arena_alloc(arena, size);
+
+    memcpy(p, old, used);
+    return p;
 }
  
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ * arena_reset - Release everything allocated from arena. If the last
+ *     cycle spilled into more than one block, they are replaced by a
+ *     single block big enough for all of it, up to ARENAKEEP bytes, so
+ *     a steady workload stops calling malloc altogether and one huge
+ *     command line doesn't hold on to its memory.
  */
-void sigtstp_handler(int sig) {
-    pid_t pid = fgpid(jobs);
-    printf("STOPPPP");
-    if (pid != 0) {
-        printf("Job [%d] (%d) stopped by signal 20\n", getjobpid(jobs, pid)->jid, pid);
-        kill(-pid, SIGTSTP);
-        struct job_t *job = getjobpid(jobs, pid);
-        job->state = ST;
+void arena_reset(struct arena_t *arena) {
+    struct arenablk_t *blk = arena->blk;
+    size_t keep;
+
+    if (arena->bytes > arena->peak)
+        arena->peak = arena->bytes;
+    arena->bytes = 0;
+    if (blk == NULL)
         return;
+    if (blk->next == NULL && blk->size <= ARENAKEEP) {
+        blk->used = 0;
+        return;
+    }
+    while (blk != NULL) {
+        struct arenablk_t *next = blk->next;
+        free(blk);
+        blk = next;
+    }
+    keep = arena->peak < ARENAKEEP ? arena->peak : ARENAKEEP;
+    if ((blk = malloc(sizeof(*blk) + keep)) == NULL)
+        unix_error("malloc error");
+    blk->size = keep;
+    blk->used = 0;
+    blk->next = NULL;
+    arena->blk = blk;
+}
+ 
+/* arena_free - Give every block of arena back to malloc */
+void arena_free(struct arena_t *arena) {
+    struct arenablk_t *blk = arena->blk;
+
+    while (blk != NULL) {
+        struct arenablk_t *next = blk->next;
+        free(blk);
+        blk = next;
     }
+    arena->blk = NULL;
+    arena->bytes = arena->peak = 0;
 }
+/*********************************
+ * end arena allocator routines
+ *********************************/
+ 
+ 
+/*****************************
+ * Glob routines
+ *****************************/
  
 /*
- * sigusr1_handler - child is ready
+ * glob_pattern - Turn the raw text of a word, [p, end), into its glob
+ *     pattern in arena: quotes are removed as lex_next does, and the
+ *     *, ?, [, ] and \ they protected are escaped with \
  */
-void sigusr1_handler(int sig) {
-    ready = 1;
+char *glob_pattern(const char *p, const char *end, struct arena_t *arena) {
+    char *pat = arena_alloc(arena, 2 * (end - p) + 1), *out = pat;     /* all escaped */
+    char quote = 0;
+
+#define PUT_QUOTED(c) do {                                      \
+        if (strchr("*?[]\\", (c)) != NULL)                      \
+            *out++ = '\\';                                      \
+        *out++ = (c);                                           \
+    } while (0)
+
+    for (; p < end; p++) {
+        if (quote == '\'') {
+            if (*p == '\'')
+                quote = 0;
+            else
+                PUT_QUOTED(*p);
+        } else if (quote == '"') {
+            if (*p == '"')
+                quote = 0;
+            else if (*p == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\'))
+                PUT_QUOTED(*++p);
+            else
+                PUT_QUOTED(*p);
+        } else if (*p == '\'' || *p == '"')
+            quote = *p;
+        else if (*p == '\\' && p + 1 < end) {
+            if (p[1] != '\n')
+                PUT_QUOTED(p[1]);
+            p++;
+        } else
+            *out++ = *p;
+    }
+#undef PUT_QUOTED
+    *out = '\0';
+    return pat;
 }
  
+/*
+ * glob_class - Parse the bracket expression at p ("[a-z]", "[!0-9]",
+ *     "[[:alpha:]_]", ...) into set. Returns the character after its
+ *     ], or NULL if it has none, in which case the [ is literal.
+ */
+static const char *glob_class(const char *p, const char *end, unsigned char set[256]) {
+    static const struct {
+        const char *name;
+        int (*fn)(int);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+        {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+        {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+        {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    const char *q = p + 1, *e;
+    int neg = 0, first = 1, lo, hi, c;
+    size_t i;
+
+    memset(set, 0, 256);
+    if (q < end && (*q == '!' || *q == '^')) {
+        neg = 1;
+        q++;
+    }
+    for (; q < end; first = 0) {
+        if (*q == ']' && !first) {
+            if (neg)
+                for (c = 1; c < 256; c++)
+                    set[c] = !set[c];
+            set['/'] = 0;
+            return q + 1;
+        }
+        if (*q == '[' && q + 1 < end && q[1] == ':'
+            && (e = memmem(q + 2, end - q - 2, ":]", 2)) != NULL) {
+            for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+                if (strlen(classes[i].name) == (size_t)(e - q - 2)
+                    && memcmp(classes[i].name, q + 2, e - q - 2) == 0)
+                    break;
+            if (i < sizeof(classes) / sizeof(classes[0])) {
+                for (c = 1; c < 256; c++)
+                    if (classes[i].fn(c))
+                        set[c] = 1;
+                q = e + 2;
+                continue;
+            }
+        }
+        if (*q == '\\' && q + 1 < end)
+            q++;
+        lo = hi = (unsigned char)*q++;
+        if (q + 1 < end && *q == '-' && q[1] != ']') {
+            q++;
+            if (*q == '\\' && q + 1 < end)
+                q++;
+            hi = (unsigned char)*q++;
+        }
+        for (c = lo; c <= hi; c++)
+            set[c] = 1;
+    }
+    return NULL;
+}
  
-/*********************
- * End signal handlers
- *********************/
+/* glob_has_meta - Does [p, p+len) have an unescaped *, ? or [...]? */
+int glob_has_meta(const char *p, size_t len) {
+    const char *end = p + len;
+    unsigned char set[256];
+
+    for (; p < end; p++) {
+        if (*p == '\\')
+            p++;
+        else if (*p == '*' || *p == '?'
+                 || (*p == '[' && glob_class(p, end, set) != NULL))
+            return 1;
+    }
+    return 0;
+}
  
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/*
+ * glob_compile - Compile the glob for one path component into gp for
+ *     glob_match: element i (a literal, ?, [...] or a run of *s) is bit
+ *     i of a state set, so matching never backtracks. Returns -1 if it
+ *     has more than 63 elements.
+ */
+int glob_compile(struct globpat_t *gp, const char *p, size_t len) {
+    const char *end = p + len, *q;
+    unsigned char set[256];
+    uint64_t bit = 1;
+    int n = 0, prevstar = 0, c;
+
+    memset(gp, 0, sizeof(*gp));
+    gp->dot = (p < end && *p == '.') || (end - p >= 2 && p[0] == '\\' && p[1] == '.');
+    while (p < end) {
+        if (*p == '*') {
+            p++;
+            if (prevstar)               /* ** is * */
+                continue;
+            prevstar = 1;
+            gp->star |= bit;
+        } else {
+            prevstar = 0;
+            if (*p == '?') {
+                for (c = 1; c < 256; c++)
+                    gp->accept[c] |= bit;
+                p++;
+            } else if (*p == '[' && (q = glob_class(p, end, set)) != NULL) {
+                for (c = 1; c < 256; c++)
+                    if (set[c])
+                        gp->accept[c] |= bit;
+                p = q;
+            } else {
+                if (*p == '\\' && p + 1 < end)
+                    p++;
+                gp->accept[(unsigned char)*p++] |= bit;
+            }
+        }
+        if (++n == 64)
+            return -1;
+        bit <<= 1;
+    }
+    gp->final = n;
+    gp->init = 1 | (gp->star & 1) << 1;
+    return 0;
+}
  
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/*
+ * glob_match - Does name match gp? One pass over name, moving every
+ *     active state at once (shift-and): a state advances if its element
+ *     takes the byte, stays if it is a *, and a * also lets the state
+ *     after it start. A leading "." must be matched literally.
+ */
+int glob_match(const struct globpat_t *gp, const char *name) {
+    uint64_t d = gp->init;
+    const unsigned char *s;
+
+    if (name[0] == '.' && !gp->dot)
+        return 0;
+    for (s = (const unsigned char *)name; *s != '\0' && d != 0; s++) {
+        d = ((d & gp->accept[*s]) << 1) | (d & gp->star);
+        d |= (d & gp->star) << 1;
+    }
+    return (d >> gp->final) & 1;
 }
  
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+/*
+ * glob_walk - Expand the path components in rest below prefix (plen
+ *     bytes, ending in / unless empty), adding each path that exists
+ *     to out
+ */
+static void glob_walk(const char *prefix, size_t plen, const char *rest,
+                      struct arena_t *arena, struct strvec_t *out) {
+    const char *slash = strchr(rest, '/');
+    size_t clen = slash != NULL ? (size_t)(slash - rest) : strlen(rest);
+    struct strvec_t dirs = {NULL, 0, 0};
+    struct globpat_t gp;
+    struct stat st;
+    char *path;
     int i;
+
+    if (!glob_has_meta(rest, clen)) {
+        const char *p;
+        path = arena_alloc(arena, plen + clen + 2);
+        memcpy(path, prefix, plen);
+        for (i = plen, p = rest; p < rest + clen; p++) {
+            if (*p == '\\' && p + 1 < rest + clen)
+                p++;
+            path[i++] = *p;
+        }
+        path[i] = '\0';
+        if (slash == NULL) {
+            if (lstat(path, &st) == 0)
+                strvec_push(out, path);
+            return;
+        }
+        path[i++] = '/';
+        path[i] = '\0';
+        glob_walk(path, i, slash + 1, arena, out);
+        return;
+    }
+
+    if (glob_compile(&gp, rest, clen) < 0)
+        return;
+    if (slash == NULL) {
+        glob_dir(prefix, plen, &gp, 0, arena, out);
+        return;
+    }
+    glob_dir(prefix, plen, &gp, 1, arena, &dirs);
+    for (i = 0; i < dirs.n; i++) {
+        size_t len = strlen(dirs.v[i]);
+        path = arena_alloc(arena, len + 2);
+        memcpy(path, dirs.v[i], len);
+        path[len] = '/';
+        path[len + 1] = '\0';
+        glob_walk(path, len + 1, slash + 1, arena, out);
+    }
+    free(dirs.v);
+}
  
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+/* glob_cmp - qsort comparison for sorting paths */
+static int glob_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
 }
  
-/* freejid - Returns smallest free job ID */
-int freejid(struct job_t *jobs) {
-    int i;
-    int taken[MAXJOBS + 1] = {0};
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid != 0) 
-        taken[jobs[i].jid] = 1;
-    for (i = 1; i <= MAXJOBS; i++)
-        if (!taken[i])
-            return i;
-    return 0;
+/*
+ * glob_expand - Add the paths matching pattern to out, sorted, with
+ *     their text in arena. Returns how many there are.
+ */
+int glob_expand(const char *pattern, struct arena_t *arena, struct strvec_t *out) {
+    int start = out->n;
+
+    glob_walk("", 0, pattern, arena, out);
+    qsort(out->v + start, out->n - start, sizeof(char *), glob_cmp);
+    return out->n - start;
 }
  
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
-    
-    if (pid < 1)
-        return 0;
-    int free = freejid(jobs);
-    if (!free) {
-        printf("Tried to create too many jobs\n");
-        return 0;
+/*
+ * glob_dir - Add prefix + name to out for each entry of directory
+ *     prefix ("" for .) that matches gp, and with dirs, is a directory.
+ *     The entries are read with getdents64 in large blocks and matched
+ *     as they come, so memory stays bounded however big the directory
+ *     is. A listing of up to DIRCACHEMAX bytes is kept in dircache and
+ *     used again until the directory's mtime changes; one modified in
+ *     the last two seconds isn't kept, as a change within the same
+ *     mtime tick would go unseen.
+ */
+void glob_dir(const char *prefix, size_t plen, const struct globpat_t *gp, int dirs,
+              struct arena_t *arena, struct strvec_t *out) {
+    static char *buf;
+    struct dirlist_t *dl = NULL, *victim = &dircache[0];
+    char *names = NULL, *path;
+    size_t len = 0, size = 0;
+    const char *p, *end, *name;
+    struct timespec now;
+    struct stat st;
+    int fd, i, keep = 1, pass = 0;
+    ssize_t n;
+
+    if ((fd = open(plen > 0 ? prefix : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return;
     }
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = free;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+    dircache_clock++;
+    for (i = 0; i < DIRCACHE; i++) {
+        struct dirlist_t *d = &dircache[i];
+        if (d->path != NULL && strcmp(d->path, prefix) == 0) {
+            if (d->dev == st.st_dev && d->ino == st.st_ino
+                && d->mtime.tv_sec == st.st_mtim.tv_sec
+                && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                dl = d;
+                break;
             }
-            return 1;
+            free(d->path);              /* the directory has changed */
+            free(d->names);
+            d->path = d->names = NULL;
+        }
+        if (d->path == NULL || (victim->path != NULL && d->used < victim->used))
+            victim = d;
+    }
+
+    if (dl != NULL) {
+        dircache_hits++;
+        dl->used = dircache_clock;
+        close(fd);
+    } else {
+        dircache_misses++;
+        if (buf == NULL && (buf = malloc(GLOBBUF)) == NULL)
+            unix_error("malloc error");
+    }
+
+    /* Each pass matches one block of entries: the cached listing, or
+     * what one getdents64 call returned */
+    for (;;) {
+        if (dl != NULL) {
+            if (pass++ > 0)
+                break;
+            p = dl->names;
+            end = p + dl->len;
+        } else {
+            if ((n = syscall(SYS_getdents64, fd, buf, GLOBBUF)) <= 0)
+                break;
+            p = buf;
+            end = buf + n;
+        }
+        while (p < end) {
+            unsigned char type;
+            size_t nlen;
+            if (dl != NULL) {
+                type = *p;
+                name = p + 1;
+                nlen = strlen(name);
+                p = name + nlen + 1;
+            } else {
+                struct dirent64_t *de = (struct dirent64_t *)p;
+                type = de->d_type;
+                name = de->d_name;
+                nlen = strlen(name);
+                p += de->d_reclen;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                    continue;
+                if (keep && len + nlen + 2 > DIRCACHEMAX) {
+                    keep = 0;           /* too big to keep */
+                    free(names);
+                    names = NULL;
+                }
+                if (keep) {
+                    if (len + nlen + 2 > size) {
+                        size = size > 0 ? 2 * size : 4096;
+                        if (size > DIRCACHEMAX)
+                            size = DIRCACHEMAX;
+                        if ((names = realloc(names, size)) == NULL)
+                            unix_error("realloc error");
+                    }
+                    names[len++] = type;
+                    memcpy(names + len, name, nlen + 1);
+                    len += nlen + 1;
+                }
+            }
+            if (!glob_match(gp, name))
+                continue;
+            path = arena_alloc(arena, plen + nlen + 1);
+            memcpy(path, prefix, plen);
+            memcpy(path + plen, name, nlen + 1);
+            if (dirs && type != DT_DIR
+                && ((type != DT_UNKNOWN && type != DT_LNK)
+                    || stat(path, &st) < 0 || !S_ISDIR(st.st_mode)))
+                continue;
+            strvec_push(out, path);
         }
     }
-    return 0; /*suppress compiler warning*/
+    if (dl != NULL)
+        return;
+
+    close(fd);
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (keep && now.tv_sec - st.st_mtim.tv_sec >= 2) {
+        free(victim->path);
+        free(victim->names);
+        if ((victim->path = strdup(prefix)) == NULL)
+            unix_error("strdup error");
+        victim->dev = st.st_dev;
+        victim->ino = st.st_ino;
+        victim->mtime = st.st_mtim;
+        victim->names = names;
+        victim->len = len;
+        victim->used = dircache_clock;
+    } else
+        free(names);
 }
  
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) {
-    int i;
- 
-    if (pid < 1)
-        return 0;
- 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            return 1;
+/*
+ * expand_globs - Expand the wildcard arguments of pl's stages. The parse
+ *     may be cached and the files change between runs, so this is done
+ *     each time the pipeline is run, into a copy in arena. A pattern
+ *     that matches nothing is passed on as it was typed. Returns pl if
+ *     it has no wildcards.
+ */
+struct pipeline_t *expand_globs(struct pipeline_t *pl, struct arena_t *arena) {
+    static struct strvec_t sv;
+    struct pipeline_t *copy;
+    struct globarg_t *g;
+    int i, j;
+
+    for (i = 0; i < pl->nstages && pl->stages[i].globs == NULL; i++)
+        ;
+    if (i == pl->nstages)
+        return pl;
+    copy = arena_alloc(arena, sizeof(*copy));
+    *copy = *pl;
+    copy->stages = arena_alloc(arena, pl->nstages * sizeof(struct stage_t));
+    memcpy(copy->stages, pl->stages, pl->nstages * sizeof(struct stage_t));
+
+    for (; i < pl->nstages; i++) {
+        struct stage_t *st = &copy->stages[i];
+        if (st->globs == NULL)
+            continue;
+        sv.n = 0;
+        for (j = 0; j < st->argc; j++) {
+            for (g = st->globs; g != NULL && g->word != st->argv[j]; g = g->next)
+                ;
+            if (g == NULL || glob_expand(g->pattern, arena, &sv) == 0)
+                strvec_push(&sv, st->argv[j]);
         }
+        st->argv = arena_alloc(arena, (sv.n + 1) * sizeof(char *));
+        memcpy(st->argv, sv.v, sv.n * sizeof(char *));
+        st->argv[sv.n] = NULL;
+        st->argc = sv.n;
     }
-    return 0;
+    return copy;
 }
  
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/* strvec_push - Add s to the end of sv */
+void strvec_push(struct strvec_t *sv, char *s) {
+    if (sv->n == sv->size) {
+        sv->size = sv->size > 0 ? 2 * sv->size : 64;
+        if ((sv->v = realloc(sv->v, sv->size * sizeof(char *))) == NULL)
+            unix_error("realloc error");
+    }
+    sv->v[sv->n++] = s;
+}
  
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG)
-            return jobs[i].pid;
-    return 0;
+/* dircache_report - With -v, say how well the directory cache did */
+void dircache_report(void) {
+    if (verbose && dircache_hits + dircache_misses > 0)
+        printf("dir cache: %ld hits, %ld misses\n", dircache_hits, dircache_misses);
 }
+/*********************************
+ * end glob routines
+ *********************************/
  
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
  
-    if (pid < 1)
+/*****************************
+ * Parse cache routines
+ *****************************/
+ 
+/*
+ * pcache_parse - Return the parse of cmdline, from the cache if the same
+ *     text was parsed recently. The result belongs to the cache and must
+ *     not be modified; it stays valid until the next call. Errors are
+ *     reported as for parseline and are not cached.
+ */
+struct pipeline_t *pcache_parse(const char *cmdline, const char **errp) {
+    size_t len = strlen(cmdline);
+    unsigned h = pcache_hash(cmdline, len);
+    struct pcent_t *e;
+
+    for (e = pcache.buckets[h % PCACHEBUCKETS]; e != NULL; e = e->hnext) {
+        if (e->hash == h && e->len == len && memcmp(e->line, cmdline, len) == 0) {
+            pcache.hits++;
+            if (e != pcache.head) {     /* move to the front */
+                e->prev->next = e->next;
+                if (e->next != NULL)
+                    e->next->prev = e->prev;
+                else
+                    pcache.tail = e->prev;
+                e->prev = NULL;
+                e->next = pcache.head;
+                pcache.head->prev = e;
+                pcache.head = e;
+            }
+            *errp = NULL;
+            return e->pl;
+        }
+    }
+
+    /* Miss: parse into a new, spare or evicted entry */
+    pcache.misses++;
+    if ((e = pcache.spare) != NULL)
+        pcache.spare = NULL;
+    else if (pcache.count < PCACHESIZE) {
+        if ((e = calloc(1, sizeof(*e))) == NULL)
+            unix_error("calloc error");
+    } else {
+        e = pcache.tail;
+        pcache_unlink(e);
+        arena_reset(&e->arena);
+    }
+    if ((e->pl = parseline(cmdline, &e->arena, errp)) == NULL) {
+        arena_reset(&e->arena);
+        pcache.spare = e;
         return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return &jobs[i];
-    return NULL;
+    }
+    e->line = arena_strndup(&e->arena, cmdline, len);
+    e->len = len;
+    e->hash = h;
+    e->prev = NULL;
+    e->next = pcache.head;
+    if (pcache.head != NULL)
+        pcache.head->prev = e;
+    pcache.head = e;
+    if (pcache.tail == NULL)
+        pcache.tail = e;
+    e->hnext = pcache.buckets[h % PCACHEBUCKETS];
+    pcache.buckets[h % PCACHEBUCKETS] = e;
+    pcache.count++;
+    return e->pl;
 }
  
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
-{
-    int i;
+/*
+ * pcache_hash - Hash a command line 8 bytes at a time, in four lanes
+ *     so the multiplies overlap: batch mode hashes every line it reads
+ */
+unsigned pcache_hash(const char *s, size_t len) {
+    const unsigned long long k = 0x9e3779b97f4a7c15ULL;
+    unsigned long long h0 = len, h1 = ~h0, h2 = k, h3 = ~k, x[4];
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        memcpy(x, s + i, 32);
+        h0 = (h0 ^ x[0]) * k;
+        h1 = (h1 ^ x[1]) * k;
+        h2 = (h2 ^ x[2]) * k;
+        h3 = (h3 ^ x[3]) * k;
+    }
+    for (; i < len; i += 8) {
+        x[0] = 0;
+        memcpy(x, s + i, len - i < 8 ? len - i : 8);
+        h0 = (h0 ^ x[0] ^ h0 >> 29) * k;
+    }
+    h0 = (h0 ^ h1 ^ h0 >> 29) * k;
+    h0 = (h0 ^ h2 ^ h0 >> 29) * k;
+    h0 = (h0 ^ h3 ^ h0 >> 29) * k;
+    return h0 ^ h0 >> 32;
+}
  
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
+/* pcache_unlink - Take e off the LRU list and out of its hash chain */
+void pcache_unlink(struct pcent_t *e) {
+    struct pcent_t **pp = &pcache.buckets[e->hash % PCACHEBUCKETS];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        pcache.head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        pcache.tail = e->prev;
+    e->prev = e->next = e->hnext = NULL;
+    pcache.count--;
 }
  
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
-    int i;
+/* pcache_report - With -v, print the cache's hit and miss counts */
+void pcache_report(void) {
+    if (verbose && parse_cache)
+        printf("parse cache: %ld hits, %ld misses, %d entries\n",
+               pcache.hits, pcache.misses, pcache.count);
+}
+/*********************************
+ * end parse cache routines
+ *********************************/
  
-    if (pid < 1)
+ 
+/*****************************
+ * Trace routines
+ *****************************/
+ 
+/*
+ * trace_open - Start a trace in Chrome's trace-event format (a JSON
+ *     array, which viewers accept without its closing bracket). The
+ *     file is opened O_APPEND and every event is one write, so forked
+ *     children can add to it without interleaving.
+ */
+void trace_open(const char *file) {
+    shell_pid = getpid();
+    if ((trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                         0644)) < 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        exit(1);
+    }
+    if (write(trace_fd, "[\n", 2) < 0)
+        unix_error("trace write error");
+    trace("M", "process_name", 0, 0, shell_pid, "\"name\":\"tsh\"");
+}
+ 
+/* trace_now - The current time in trace units (microseconds), or 0 */
+double trace_now(void) {
+    struct timespec ts;
+
+    if (trace_fd < 0)
         return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid) {
-            return jobs[i].jid;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return trace_ts(&ts);
+}
+ 
+/* trace_ts - A CLOCK_MONOTONIC reading in trace units */
+double trace_ts(const struct timespec *ts) {
+    return ts->tv_sec * 1e6 + ts->tv_nsec / 1e3;
+}
+ 
+/*
+ * trace - Write one event: phase ph ("X" complete, "i" instant, "M"
+ *     metadata) at ts lasting dur, on the timeline of process tid; or,
+ *     for "b"/"e" (job begin/end), of the job whose jid is tid. fmt
+ *     formats the members of its args object.
+ */
+void trace(const char *ph, const char *name, double ts, double dur, pid_t tid,
+           const char *fmt, ...) {
+    char buf[TRACEBUF];
+    va_list ap;
+    int n;
+
+    if (trace_fd < 0)
+        return;
+    n = snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,"
+                 "\"pid\":%d,", name, ph, ts, (int)shell_pid);
+    if (ph[0] == 'b' || ph[0] == 'e')
+        n += snprintf(buf + n, sizeof(buf) - n, "\"tid\":%d,\"cat\":\"job\",\"id\":%d",
+                      (int)shell_pid, (int)tid);
+    else
+        n += snprintf(buf + n, sizeof(buf) - n, "\"tid\":%d", (int)tid);
+    if (ph[0] == 'X')
+        n += snprintf(buf + n, sizeof(buf) - n, ",\"dur\":%.3f", dur);
+    else if (ph[0] == 'i')
+        n += snprintf(buf + n, sizeof(buf) - n, ",\"s\":\"t\"");
+    n += snprintf(buf + n, sizeof(buf) - n, ",\"args\":{");
+    va_start(ap, fmt);
+    n += vsnprintf(buf + n, sizeof(buf) - n, fmt, ap);
+    va_end(ap);
+    n += snprintf(buf + n, sizeof(buf) - n, "}},\n");
+    if (n >= (int)sizeof(buf))
+        return;                         /* better no event than bad JSON */
+    if (write(trace_fd, buf, n) < 0) {
+        close(trace_fd);
+        trace_fd = -1;
     }
-    return 0;
 }
  
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-                case BG: 
-                    printf("Running ");
-                    break;
-                case FG: 
-                    printf("Foreground ");
-                    break;
-                case ST: 
-                    printf("Stopped ");
-                    break;
-                default:
-                    printf("listjobs: Internal error: job[%d].state=%d ", 
-                       i, jobs[i].state);
-            }
-            printf("%s", jobs[i].cmdline);
-        }
+/*
+ * json_str - Quote src as a JSON string into dst, truncating it to fit.
+ *     Returns dst.
+ */
+char *json_str(char *dst, size_t size, const char *src) {
+    size_t len = 0;
+
+    dst[len++] = '"';
+    for (; *src != '\0' && len + 8 < size; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\') {
+            dst[len++] = '\\';
+            dst[len++] = c;
+        } else if (c < ' ')
+            len += sprintf(dst + len, "\\u%04x", c);
+        else
+            dst[len++] = c;
     }
+    dst[len++] = '"';
+    dst[len] = '\0';
+    return dst;
 }
-/******************************
- * end job list helper routines
- ******************************/
+/*********************************
+ * end trace routines
+ *********************************/
  
  
 /***********************
  * Other helper routines
  ***********************/
  
+/*
+ * parse_size - Parse a byte count with an optional K, M or G suffix.
+ *     Returns 0 on success, -1 if str is not a positive size.
+ */
+int parse_size(const char *str, long *size) {
+    char *end;
+    long n = strtol(str, &end, 10);
+    int shift = 0;
+
+    if (end == str || n <= 0 || n == LONG_MAX)
+        return -1;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+    }
+    if (*end != '\0' || n > LONG_MAX >> shift)
+        return -1;
+    n <<= shift;
+    *size = n;
+    return 0;
+}
+ 
+/* format_bytes - Write n as a size with a K, M, G or T suffix, e.g. "1.5M" */
+char *format_bytes(char *buf, size_t size, double n) {
+    const char *units = "KMGT";
+    int u = -1;
+
+    while (n >= 1024 && u < 3) {
+        n /= 1024;
+        u++;
+    }
+    if (u < 0)
+        snprintf(buf, size, "%.0f", n);
+    else
+        snprintf(buf, size, "%.1f%c", n, units[u]);
+    return buf;
+}
+ 
 /*
  * usage - print a help message and terminate
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpsm] [-b size] [-j n] [-t file] [-z n] [script]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -s   launch commands with posix_spawn instead of fork\n");
+    printf("   -m   meter pipeline pipes: rates in jobs -l, a summary at the end\n");
+    printf("   -b   set the buffer size of pipeline pipes (e.g. 1M)\n");
+    printf("   -j   run at most n background jobs at once, queueing the rest\n");
+    printf("   -t   write a Chrome trace-event timeline to file\n");
+    printf("   -z   keep n pre-forked helpers to launch commands from\n");
     exit(1);
 }
  
@@ -861,6 +6143,11 @@ handler_t *Signal(int signum, handler_t *handler) {
  *    child shell by sending it a SIGQUIT signal.
  */
 void sigquit_handler(int sig) {
-    printf("Terminating after receipt of SIGQUIT signal\n");
-    exit(1);
+    static const char msg[] = "Terminating after receipt of SIGQUIT signal\n";
+    ssize_t rc;
+
+    /* write and _exit, not printf and exit: this is a signal handler */
+    rc = write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    (void)rc;
+    _exit(1);
 }
\ No newline at end of file